@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <span>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "chart.hpp"
+
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+namespace
+{
+
+void hash_combine(std::size_t& seed, std::size_t value)
+{
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+template<typename T>
+auto capacity_bytes(std::vector<T> const& buffer) -> std::size_t
+{
+    return buffer.capacity() * sizeof(T);
+}
+
+}  // namespace
+
+ChartGrammar::ChartGrammar(Pcfg const& grammar)
+{
+    auto add_category = [&](Nonterminal const& category)
+    {
+        auto [iter, inserted] = m_ids.try_emplace(category, static_cast<int>(m_categories.size()));
+        if (inserted) {
+            m_categories.push_back(category);
+        }
+        return iter->second;
+    };
+
+    m_start = add_category(grammar.start());
+
+    std::map<std::pair<int, std::vector<ChartSymbol>>, std::size_t> shapes {};
+    auto const& productions = grammar.productions();
+    m_productions.reserve(productions.size());
+    for (std::size_t i = 0; i < productions.size(); ++i) {
+        auto const& prod = productions[i];
+        const int lhs = add_category(prod.lhs);
+
+        auto rhs = std::vector<ChartSymbol> {};
+        rhs.reserve(prod.rhs.size());
+        for (auto const& symbol : prod.rhs) {
+            if (std::holds_alternative<LetterType>(symbol)) {
+                rhs.emplace_back(std::get<LetterType>(symbol));
+            } else {
+                rhs.emplace_back(add_category(std::get<Nonterminal>(symbol)));
+            }
+        }
+
+        const auto shape = shapes.try_emplace({lhs, rhs}, i).first->second;
+        m_productions.push_back({lhs, std::move(rhs), std::log(prod.prob), shape});
+    }
+
+    m_productions_by_lhs.resize(m_categories.size());
+    for (std::size_t i = 0; i < m_productions.size(); ++i) {
+        auto const& prod = m_productions[i];
+        m_productions_by_lhs[static_cast<std::size_t>(prod.lhs)].push_back(i);
+        if (prod.rhs.size() == 1 and std::holds_alternative<int>(prod.rhs[0])) {
+            m_unary_productions.push_back(i);
+        }
+    }
+}
+
+auto ChartGrammar::reweighted(Pcfg const& grammar) const -> ChartGrammar
+{
+    auto result = *this;
+    auto const& productions = grammar.productions();
+    for (std::size_t i = 0; i < productions.size(); ++i) {
+        result.m_productions[i].log_prob = std::log(productions[i].prob);
+    }
+    return result;
+}
+
+auto ChartGrammar::num_categories() const -> int
+{
+    return static_cast<int>(m_categories.size());
+}
+
+auto ChartGrammar::start() const -> int
+{
+    return m_start;
+}
+
+auto ChartGrammar::id(Nonterminal const& category) const -> int
+{
+    auto iter = m_ids.find(category);
+    return iter == m_ids.end() ? -1 : iter->second;
+}
+
+auto ChartGrammar::category(int id) const -> Nonterminal const&
+{
+    return m_categories[static_cast<std::size_t>(id)];
+}
+
+auto ChartGrammar::productions() const -> std::vector<Production> const&
+{
+    return m_productions;
+}
+
+auto ChartGrammar::productions_of(int lhs) const -> std::vector<std::size_t> const&
+{
+    return m_productions_by_lhs[static_cast<std::size_t>(lhs)];
+}
+
+auto ChartGrammar::unary_productions() const -> std::vector<std::size_t> const&
+{
+    return m_unary_productions;
+}
+
+void Chart::reset(int num_nodes, int num_categories, int top_k)
+{
+    m_num_nodes = num_nodes;
+    m_num_categories = num_categories;
+    m_top_k = std::max(top_k, 0);
+
+    // Bumping the generation empties every span at once.
+    if (++m_generation == 0) {
+        for (auto& span : m_spans) {
+            span.generation = 0;
+        }
+        m_generation = 1;
+    }
+
+    const auto num_spans = static_cast<std::size_t>(num_nodes) * static_cast<std::size_t>(num_nodes);
+    if (m_spans.size() < num_spans) {
+        m_spans.resize(num_spans);
+    }
+
+    // Left over if the previous parse was interrupted.
+    for (std::size_t i = 0; i < m_num_open; ++i) {
+        auto& open = m_open_cells[i];
+        m_open_slots[static_cast<std::size_t>(open.category)] = no_slot;
+        open.members.clear();
+    }
+    m_num_open = 0;
+    if (m_open_slots.size() < static_cast<std::size_t>(num_categories)) {
+        m_open_slots.resize(static_cast<std::size_t>(num_categories), no_slot);
+    }
+    m_open_begin = -1;
+    m_open_end = -1;
+    m_proposals.clear();
+    m_proposal_children.clear();
+
+    m_cells.clear();
+    m_members.clear();
+    m_entries.clear();
+    m_children.clear();
+}
+
+auto Chart::cell(int begin, int end, int category) const -> std::span<const std::uint32_t>
+{
+    if (begin == m_open_begin and end == m_open_end) {
+        const auto slot = m_open_slots[static_cast<std::size_t>(category)];
+        if (slot == no_slot) {
+            return {};
+        }
+        return m_open_cells[slot].members;
+    }
+
+    auto const& span = m_spans[index(begin, end)];
+    if (span.generation != m_generation) {
+        return {};
+    }
+    auto const* first = m_cells.data() + span.first;
+    auto const* last = first + span.size;
+    auto const* cell =
+        std::lower_bound(first, last, category, [](Cell const& lhs, int rhs) { return lhs.category < rhs; });
+    if (cell == last or cell->category != category) {
+        return {};
+    }
+    return {m_members.data() + cell->first, cell->size};
+}
+
+auto Chart::entry(std::uint32_t id) const -> Entry const&
+{
+    return m_entries[id];
+}
+
+auto Chart::num_entries() const -> std::size_t
+{
+    return m_entries.size();
+}
+
+auto Chart::children(Entry const& entry, std::size_t size) const -> std::span<const std::uint32_t>
+{
+    return {m_children.data() + entry.children, size};
+}
+
+auto Chart::index(int begin, int end) const -> std::size_t
+{
+    return static_cast<std::size_t>(begin) * static_cast<std::size_t>(m_num_nodes) + static_cast<std::size_t>(end);
+}
+
+void Chart::open(int begin, int end)
+{
+    m_open_begin = begin;
+    m_open_end = end;
+}
+
+auto Chart::offer(int category, Entry const& candidate, std::span<const std::uint32_t> children) -> bool
+{
+    const auto slots = static_cast<std::size_t>(m_top_k);
+    auto& slot = m_open_slots[static_cast<std::size_t>(category)];
+    auto members = slot == no_slot ? std::span<std::uint32_t> {} : std::span {m_open_cells[slot].members};
+    const auto size = members.size();
+    const auto structure = structure_of(candidate, children);
+
+    std::size_t worst = 0;
+    float worst_log_prob = std::numeric_limits<float>::max();
+    for (std::size_t i = 0; i < size; ++i) {
+        auto const& other = m_entries[members[i]];
+        if (other.structure == structure
+            and same_structure(other, {m_children.data() + other.children, other.num_children}, candidate, children))
+        {
+            if (not(other.log_prob < candidate.log_prob)) {
+                return false;
+            }
+            members[i] = add_entry(candidate, children, structure);
+            return true;
+        }
+        if (other.log_prob < worst_log_prob) {
+            worst = i;
+            worst_log_prob = other.log_prob;
+        }
+    }
+
+    // A full cell trades its worst entry for better ones.
+    if (size == slots and not(worst_log_prob < candidate.log_prob)) {
+        return false;
+    }
+
+    const auto id = add_entry(candidate, children, structure);
+    if (size == slots) {
+        members[worst] = id;
+        return true;
+    }
+    if (slot == no_slot) {
+        // Open a cell for the category, reusing the buffer of one that
+        // was opened in an earlier span.
+        if (m_num_open == m_open_cells.size()) {
+            m_open_cells.emplace_back();
+        }
+        slot = static_cast<std::uint32_t>(m_num_open++);
+        m_open_cells[slot].category = category;
+    }
+    m_open_cells[slot].members.push_back(id);
+    return true;
+}
+
+auto Chart::add_entry(Entry const& candidate, std::span<const std::uint32_t> children, std::size_t structure)
+    -> std::uint32_t
+{
+    const auto id = static_cast<std::uint32_t>(m_entries.size());
+    auto& entry = m_entries.emplace_back(candidate);
+    entry.children = static_cast<std::uint32_t>(m_children.size());
+    entry.num_children = static_cast<std::uint32_t>(children.size());
+    entry.structure = structure;
+    m_children.insert(m_children.end(), children.begin(), children.end());
+    return id;
+}
+
+auto Chart::structure_of(Entry const& entry, std::span<const std::uint32_t> children) const -> std::size_t
+{
+    // Children contribute the hash they cached, so this takes time in
+    // the number of children only.
+    std::size_t result = std::hash<std::int32_t> {}(entry.production);
+    hash_combine(result, std::hash<Tree const*> {}(entry.lexical));
+    for (auto child : children) {
+        hash_combine(result, child == letter_child ? 0 : m_entries[child].structure);
+    }
+    return result;
+}
+
+auto Chart::same_structure(Entry const& lhs,
+                           std::span<const std::uint32_t> lhs_children,
+                           Entry const& rhs,
+                           std::span<const std::uint32_t> rhs_children) const -> bool
+{
+    if (lhs.production != rhs.production or lhs.lexical != rhs.lexical or lhs_children.size() != rhs_children.size())
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < lhs_children.size(); ++i) {
+        const auto left = lhs_children[i];
+        const auto right = rhs_children[i];
+        if (left == right) {
+            continue;
+        }
+        if (left == letter_child or right == letter_child) {
+            return false;
+        }
+        auto const& left_entry = m_entries[left];
+        auto const& right_entry = m_entries[right];
+        if (left_entry.structure != right_entry.structure
+            or not same_structure(left_entry,
+                                  {m_children.data() + left_entry.children, left_entry.num_children},
+                                  right_entry,
+                                  {m_children.data() + right_entry.children, right_entry.num_children}))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Chart::propose(int category, Entry const& candidate, std::span<const std::uint32_t> children)
+{
+    auto& proposal = m_proposals.emplace_back(Proposal {category, candidate, static_cast<std::uint32_t>(children.size())});
+    proposal.entry.children = static_cast<std::uint32_t>(m_proposal_children.size());
+    m_proposal_children.insert(m_proposal_children.end(), children.begin(), children.end());
+}
+
+auto Chart::commit() -> bool
+{
+    bool added = false;
+    for (auto const& proposal : m_proposals) {
+        auto const children = std::span {m_proposal_children.data() + proposal.entry.children, proposal.num_children};
+        added = offer(proposal.category, proposal.entry, children) or added;
+    }
+    m_proposals.clear();
+    m_proposal_children.clear();
+    return added;
+}
+
+void Chart::close()
+{
+    const auto first = m_cells.size();
+    for (std::size_t i = 0; i < m_num_open; ++i) {
+        auto& open = m_open_cells[i];
+        m_cells.push_back({open.category,
+                           static_cast<std::uint32_t>(m_members.size()),
+                           static_cast<std::uint32_t>(open.members.size())});
+        m_members.insert(m_members.end(), open.members.begin(), open.members.end());
+        m_open_slots[static_cast<std::size_t>(open.category)] = no_slot;
+        open.members.clear();
+    }
+    std::sort(m_cells.begin() + static_cast<std::ptrdiff_t>(first),
+              m_cells.end(),
+              [](Cell const& lhs, Cell const& rhs) { return lhs.category < rhs.category; });
+    if (m_num_open > 0) {
+        m_spans[index(m_open_begin, m_open_end)] = {
+            m_generation, static_cast<std::uint32_t>(first), static_cast<std::uint32_t>(m_num_open)};
+    }
+    m_num_open = 0;
+    m_open_begin = -1;
+    m_open_end = -1;
+}
+
+auto Chart::reserved_bytes() const -> std::size_t
+{
+    std::size_t open_members = 0;
+    for (auto const& open : m_open_cells) {
+        open_members += capacity_bytes(open.members);
+    }
+    return capacity_bytes(m_spans) + capacity_bytes(m_cells) + capacity_bytes(m_members) + capacity_bytes(m_entries)
+        + capacity_bytes(m_children) + capacity_bytes(m_open_cells) + open_members + capacity_bytes(m_open_slots)
+        + capacity_bytes(m_proposals) + capacity_bytes(m_proposal_children);
+}
+
+}  // namespace parser
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <span>
+#include <variant>
+#include <vector>
+
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+#include "tree.h"
+
+namespace parser
+{
+
+using ChartSymbol = std::variant<int, LetterType>;  // a category id, or a letter
+
+/**
+ * A grammar whose categories are numbered densely, the way the chart
+ * indexes them.  Productions keep the order and indices of the Pcfg.
+ */
+class ChartGrammar
+{
+  public:
+    struct Production
+    {
+        int lhs;
+        std::vector<ChartSymbol> rhs;
+        float log_prob;
+        // Index of the first production with the same lhs and rhs, whose
+        // trees are indistinguishable from the trees of this one.
+        std::size_t shape;
+    };
+
+  private:
+    std::map<Nonterminal, int> m_ids;
+    std::vector<Nonterminal> m_categories;
+    int m_start;
+    std::vector<Production> m_productions;
+    std::vector<std::vector<std::size_t>> m_productions_by_lhs;
+    std::vector<std::size_t> m_unary_productions;  // productions whose rhs is a single category
+
+  public:
+    explicit ChartGrammar(Pcfg const& grammar);
+
+    /**
+     * @return this grammar with the probabilities of `grammar`, a
+     * re-weighting of the grammar it was built from.
+     */
+    auto reweighted(Pcfg const& grammar) const -> ChartGrammar;
+
+    auto num_categories() const -> int;
+    auto start() const -> int;
+
+    /**
+     * @return the id of `category`, or -1 if it does not appear in the grammar.
+     */
+    auto id(Nonterminal const& category) const -> int;
+    auto category(int id) const -> Nonterminal const&;
+
+    auto productions() const -> std::vector<Production> const&;
+    auto productions_of(int lhs) const -> std::vector<std::size_t> const&;
+    auto unary_productions() const -> std::vector<std::size_t> const&;
+};
+
+/**
+ * The constituents of one parse, stored by (begin, end) and, within a
+ * span, only for the categories that have any, in buffers that are kept
+ * from one parse to the next.  Constituents are entries of an arena and
+ * refer to their children by index.
+ *
+ * Cells are filled one span at a time: between `open()` and `close()`,
+ * `offer()` adds candidates to the cells of the open span, keeping the
+ * best ones.  Once closed, the cells of a span do not change.
+ */
+class Chart
+{
+  public:
+    struct Entry
+    {
+        float log_prob = 0.F;
+        std::int32_t production = -1;  // shape of the production, or -1 for a tree of the lexicon
+        std::uint32_t children = 0;  // offset in the children arena, one per rhs symbol
+        std::uint32_t num_children = 0;
+        Tree const* lexical = nullptr;
+        // Hash of the tree of the entry, which does not depend on the
+        // lattice path it spells.  Set by the chart.
+        std::size_t structure = 0;
+    };
+
+    // The child "entry" of an rhs letter.
+    static constexpr std::uint32_t letter_child = std::numeric_limits<std::uint32_t>::max();
+
+  private:
+    struct Span
+    {
+        std::uint32_t generation = 0;
+        std::uint32_t first = 0;  // offset of its cells in `m_cells`
+        std::uint32_t size = 0;
+    };
+
+    struct Cell
+    {
+        int category;
+        std::uint32_t first;  // offset of its entries in `m_members`
+        std::uint32_t size;
+    };
+
+    struct OpenCell
+    {
+        int category = -1;
+        std::vector<std::uint32_t> members;
+    };
+
+    struct Proposal
+    {
+        int category;
+        Entry entry;  // `entry.children` is an offset in `m_proposal_children`
+        std::uint32_t num_children;
+    };
+
+    int m_num_nodes = 0;
+    int m_num_categories = 0;
+    int m_top_k = 1;
+    std::uint32_t m_generation = 0;  // spans of older generations are empty
+
+    std::vector<Span> m_spans;  // by (begin, end)
+    std::vector<Cell> m_cells;  // the non-empty cells of the closed spans, by category within a span
+    std::vector<std::uint32_t> m_members;  // entries of the closed cells
+    std::vector<Entry> m_entries;
+    std::vector<std::uint32_t> m_children;
+
+    // The non-empty cells of the open span.  Cells past `m_num_open` are
+    // unused but keep the capacity of their members.
+    int m_open_begin = -1;
+    int m_open_end = -1;
+    std::vector<OpenCell> m_open_cells;
+    std::size_t m_num_open = 0;
+    std::vector<std::uint32_t> m_open_slots;  // by category, the index of its open cell or `no_slot`
+    std::vector<Proposal> m_proposals;
+    std::vector<std::uint32_t> m_proposal_children;
+
+  public:
+    /**
+     * Empty the chart and size it for a lattice of `num_nodes` nodes.
+     * Takes constant time unless the chart has to grow.
+     */
+    void reset(int num_nodes, int num_categories, int top_k);
+
+    /**
+     * @return the entries of a cell, which may belong to the open span.
+     */
+    auto cell(int begin, int end, int category) const -> std::span<const std::uint32_t>;
+
+    auto entry(std::uint32_t id) const -> Entry const&;
+    auto num_entries() const -> std::size_t;
+
+    /**
+     * @return the child entries of `entry`, which has `size` rhs symbols.
+     */
+    auto children(Entry const& entry, std::size_t size) const -> std::span<const std::uint32_t>;
+
+    void open(int begin, int end);
+
+    /**
+     * Add a candidate to the cell of `category` in the open span, unless
+     * the cell is full of better ones.  If the cell holds the same tree
+     * already, spelled along another path of the lattice, only the better
+     * of the two is kept.
+     *
+     * @return whether the candidate was added.
+     */
+    auto offer(int category, Entry const& candidate, std::span<const std::uint32_t> children) -> bool;
+
+    /**
+     * Set a candidate aside for the next `commit()`, so that the cells of
+     * the open span stay as they are while more candidates are found.
+     */
+    void propose(int category, Entry const& candidate, std::span<const std::uint32_t> children);
+
+    /**
+     * Offer the proposed candidates, in the order they were proposed.
+     *
+     * @return whether any of them was added.
+     */
+    auto commit() -> bool;
+
+    void close();
+
+    /**
+     * @return the bytes held by the buffers of the chart.
+     */
+    auto reserved_bytes() const -> std::size_t;
+
+  private:
+    static constexpr std::uint32_t no_slot = std::numeric_limits<std::uint32_t>::max();
+
+    auto index(int begin, int end) const -> std::size_t;
+    auto structure_of(Entry const& entry, std::span<const std::uint32_t> children) const -> std::size_t;
+    auto same_structure(Entry const& lhs,
+                        std::span<const std::uint32_t> lhs_children,
+                        Entry const& rhs,
+                        std::span<const std::uint32_t> rhs_children) const -> bool;
+    auto add_entry(Entry const& candidate, std::span<const std::uint32_t> children, std::size_t structure)
+        -> std::uint32_t;
+};
+
+}  // namespace parser
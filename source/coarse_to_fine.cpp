@@ -0,0 +1,594 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <map>
+#include <span>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "coarse_to_fine.hpp"
+
+#include "grammar_optimizer.hpp"
+#include "letter_trie.hpp"
+#include "nonterminal.hpp"
+#include "parse_limits.hpp"
+#include "pcfg.hpp"
+#include "tree.h"
+
+namespace parser
+{
+
+namespace
+{
+
+constexpr float impossible = -std::numeric_limits<float>::infinity();
+
+auto is_impossible(float log_prob) -> bool
+{
+    return std::isinf(log_prob);
+}
+
+/**
+ * @return log(exp(lhs) + exp(rhs)).
+ */
+auto log_add(float lhs, float rhs) -> float
+{
+    if (is_impossible(lhs)) {
+        return rhs;
+    }
+    if (is_impossible(rhs)) {
+        return lhs;
+    }
+    const float high = std::max(lhs, rhs);
+    return high + std::log1p(std::exp(std::min(lhs, rhs) - high));
+}
+
+/**
+ * @return whether a score changed by more than rounding would explain.
+ */
+auto changed_score(float before, float after) -> bool
+{
+    if (is_impossible(before) or is_impossible(after)) {
+        return is_impossible(before) != is_impossible(after);
+    }
+    return std::abs(after - before) > 1e-6F * std::max(1.F, std::abs(before));
+}
+
+auto merge_bounds(YieldBounds lhs, YieldBounds rhs) -> YieldBounds
+{
+    return {std::min(lhs.min, rhs.min), std::max(lhs.max, rhs.max)};
+}
+
+/**
+ * @return the offset of the cell of `category` over (begin, end) in
+ * `scratch.cells`, or `scratch.cells.size()` if it has no derivation.
+ */
+auto find_cell(CoarseScratch const& scratch, int num_nodes, int begin, int end, int category) -> std::size_t
+{
+    auto const& span = scratch.spans[static_cast<std::size_t>(begin) * static_cast<std::size_t>(num_nodes)
+                                     + static_cast<std::size_t>(end)];
+    auto const first = scratch.cells.begin() + span.first;
+    auto const last = first + span.size;
+    auto const cell = std::lower_bound(
+        first, last, category, [](CoarseScratch::Cell const& lhs, int rhs) { return lhs.category < rhs; });
+    if (cell == last or cell->category != category) {
+        return scratch.cells.size();
+    }
+    return static_cast<std::size_t>(cell - scratch.cells.begin());
+}
+
+}  // namespace
+
+auto strip_suffix_projection(char separator) -> CategoryProjection
+{
+    return [separator](Nonterminal const& category)
+    {
+        auto name = category.name();
+        return Nonterminal {name.substr(0, name.find(separator))};
+    };
+}
+
+auto CoarseScratch::reserved_bytes() const -> std::size_t
+{
+    return spans.capacity() * sizeof(Span) + cells.capacity() * sizeof(Cell) + allowed.capacity() / CHAR_BIT
+        + seeds.capacity() * sizeof(LexicalSeed) + splits.capacity() * sizeof(int)
+        + (span_scores.capacity() + span_base.capacity() + span_next.capacity()) * sizeof(float);
+}
+
+CoarseChart::CoarseChart(int num_nodes, CoarseScratch const& scratch, ParseStatus status)
+    : m_num_nodes {num_nodes}
+    , m_scratch {&scratch}
+    , m_status {status}
+{
+}
+
+auto CoarseChart::allows(int begin, int end, int category) const -> bool
+{
+    if (m_status != ParseStatus::Complete) {
+        return false;
+    }
+    if (category < 0) {
+        return true;
+    }
+    const auto cell = find_cell(*m_scratch, m_num_nodes, begin, end, category);
+    return cell < m_scratch->allowed.size() and m_scratch->allowed[cell];
+}
+
+auto CoarseChart::status() const -> ParseStatus
+{
+    return m_status;
+}
+
+namespace
+{
+
+/**
+ * Inside and outside log-probabilities of every coarse constituent over
+ * one lattice, summed over all its derivations and contexts.  Like the
+ * fine chart, it keeps per (begin, end) span only the categories that
+ * have a derivation there, in the buffers of a CoarseScratch.
+ */
+template<typename Rule>
+class CoarsePass
+{
+    using Symbol = std::variant<int, LetterType>;
+    using Cell = CoarseScratch::Cell;
+
+    std::vector<Rule> const& m_rules;
+    std::vector<YieldBounds> const& m_category_bounds;
+    Lattice const& m_lattice;
+    int m_num_nodes;
+    int m_num_categories;
+    CoarseScratch& m_scratch;
+
+  public:
+    CoarsePass(std::vector<Rule> const& rules,
+               std::vector<YieldBounds> const& category_bounds,
+               Lattice const& lattice,
+               CoarseScratch& scratch)
+        : m_rules {rules}
+        , m_category_bounds {category_bounds}
+        , m_lattice {lattice}
+        , m_num_nodes {lattice.num_nodes()}
+        , m_num_categories {static_cast<int>(category_bounds.size())}
+        , m_scratch {scratch}
+    {
+        const auto nodes = static_cast<std::size_t>(m_num_nodes);
+        const auto categories = static_cast<std::size_t>(m_num_categories);
+        m_scratch.spans.assign(nodes * nodes, {});
+        m_scratch.cells.clear();
+        m_scratch.seeds.clear();
+        m_scratch.span_scores.resize(categories);
+        m_scratch.span_base.resize(categories);
+        m_scratch.span_next.resize(categories);
+    }
+
+    /**
+     * @return the number of spans and constituents held, as they count
+     * against the chart budget.
+     */
+    auto num_entries() const -> std::size_t { return m_scratch.spans.size() + m_scratch.cells.size(); }
+
+    auto cells() const -> std::vector<Cell> const& { return m_scratch.cells; }
+
+    /**
+     * Add the inside score of a lexical tree, before `compute_inside()`.
+     */
+    void add_lexical(int begin, int end, int category, float log_prob)
+    {
+        m_scratch.seeds.push_back({begin, end, category, log_prob});
+    }
+
+    /**
+     * @return the cell of `category` over (begin, end), or null if it has
+     * no derivation.
+     */
+    auto find(int begin, int end, int category) -> Cell*
+    {
+        const auto cell = find_cell(m_scratch, m_num_nodes, begin, end, category);
+        return cell < m_scratch.cells.size() ? &m_scratch.cells[cell] : nullptr;
+    }
+
+    auto symbol_inside(Symbol const& symbol, int begin, int end) -> float
+    {
+        if (std::holds_alternative<LetterType>(symbol)) {
+            return m_lattice.letter(begin, end, std::get<LetterType>(symbol)).value_or(impossible);
+        }
+        auto const* cell = find(begin, end, std::get<int>(symbol));
+        return cell == nullptr ? impossible : cell->inside;
+    }
+
+    auto symbol_bounds(Symbol const& symbol) const -> YieldBounds
+    {
+        if (std::holds_alternative<LetterType>(symbol)) {
+            return {1, 1};
+        }
+        return m_category_bounds[static_cast<std::size_t>(std::get<int>(symbol))];
+    }
+
+    /**
+     * Call `callback(splits, score)` for every way of splitting
+     * (begin, end) among `rhs` such that every symbol has an inside
+     * score, where `score` is the sum of those inside scores.
+     */
+    template<typename Callback>
+    void for_each_split(
+        std::span<const Symbol> rhs, int begin, int end, std::vector<int>& splits, float score, Callback&& callback)
+    {
+        if (rhs.empty()) {
+            if (begin == end) {
+                callback(splits, score);
+            }
+            return;
+        }
+
+        // The last symbol takes whatever is left of the span.
+        auto bounds = symbol_bounds(rhs[0]);
+        for (int split = rhs.size() == 1 ? end : begin + 1; split <= end; ++split) {
+            if (not overlap(m_lattice.distance(begin, split), bounds)) {
+                continue;
+            }
+            const float left = symbol_inside(rhs[0], begin, split);
+            if (is_impossible(left)) {
+                continue;
+            }
+            splits.push_back(split);
+            for_each_split(rhs.subspan(1), split, end, splits, score + left, callback);
+            splits.pop_back();
+        }
+    }
+
+    /**
+     * @return `Complete`, or which of `limits` stopped the pass.
+     */
+    auto compute_inside(ParseLimits const& limits) -> ParseStatus
+    {
+        // Seeds in the order their spans are computed.
+        auto& seeds = m_scratch.seeds;
+        auto span_order = [](auto const& seed) { return std::pair {seed.end - seed.begin, seed.begin}; };
+        std::sort(seeds.begin(),
+                  seeds.end(),
+                  [&](auto const& lhs, auto const& rhs) { return span_order(lhs) < span_order(rhs); });
+        auto seed = seeds.begin();
+
+        auto& splits = m_scratch.splits;
+        auto& scores = m_scratch.span_scores;
+        for (int length = 1; length < m_num_nodes; ++length) {
+            for (int begin = 0; begin + length < m_num_nodes; ++begin) {
+                const int end = begin + length;
+                const auto distance = m_lattice.distance(begin, end);
+                if (distance.min > distance.max) {
+                    continue;
+                }
+                if (auto status = check_limits(limits, num_entries()); status != ParseStatus::Complete) {
+                    return status;
+                }
+
+                std::fill(scores.begin(), scores.end(), impossible);
+                for (; seed != seeds.end() and span_order(*seed) <= std::pair {length, begin}; ++seed) {
+                    if (span_order(*seed) == std::pair {length, begin}) {
+                        auto& total = scores[static_cast<std::size_t>(seed->category)];
+                        total = log_add(total, seed->log_prob);
+                    }
+                }
+
+                for (auto const& rule : m_rules) {
+                    if (rule.unary or not overlap(distance, rule.bounds)) {
+                        continue;
+                    }
+                    auto& total = scores[static_cast<std::size_t>(rule.lhs)];
+                    splits.assign(1, begin);
+                    for_each_split(rule.rhs,
+                                   begin,
+                                   end,
+                                   splits,
+                                   rule.log_prob,
+                                   [&](std::vector<int> const& /*unused*/, float score)
+                                   { total = log_add(total, score); });
+                }
+
+                // Unary rules feed each other within the span.
+                close_unary_rules(distance,
+                                  scores.data(),
+                                  [](Rule const& rule) { return std::get<int>(rule.rhs[0]); },
+                                  [](Rule const& rule) { return rule.lhs; });
+
+                // Keep the categories with a derivation, in order.
+                auto& cells = m_scratch.cells;
+                const auto first = cells.size();
+                for (int category = 0; category < m_num_categories; ++category) {
+                    const float inside = scores[static_cast<std::size_t>(category)];
+                    if (not is_impossible(inside)) {
+                        cells.push_back({category, inside, impossible});
+                    }
+                }
+                m_scratch.spans[span_index(begin, end)] = {static_cast<std::uint32_t>(first),
+                                                           static_cast<std::uint32_t>(cells.size() - first)};
+            }
+        }
+        return ParseStatus::Complete;
+    }
+
+    /**
+     * @return `Complete`, or which of `limits` stopped the pass.
+     */
+    auto compute_outside(int start, ParseLimits const& limits) -> ParseStatus
+    {
+        auto* root = find(0, m_num_nodes - 1, start);
+        if (root == nullptr) {
+            return ParseStatus::Complete;
+        }
+        root->outside = 0.F;
+
+        auto& splits = m_scratch.splits;
+        auto& scores = m_scratch.span_scores;
+        for (int length = m_num_nodes - 1; length >= 1; --length) {
+            for (int begin = 0; begin + length < m_num_nodes; ++begin) {
+                const int end = begin + length;
+                const auto distance = m_lattice.distance(begin, end);
+                if (distance.min > distance.max) {
+                    continue;
+                }
+                if (auto status = check_limits(limits, num_entries()); status != ParseStatus::Complete) {
+                    return status;
+                }
+                auto const& span = m_scratch.spans[span_index(begin, end)];
+                if (span.size == 0) {
+                    continue;
+                }
+
+                // The longer spans are done, so only the unary rules of
+                // this span still add to its outside scores.
+                auto const span_cells = std::span {m_scratch.cells.data() + span.first, span.size};
+                std::fill(scores.begin(), scores.end(), impossible);
+                for (auto const& cell : span_cells) {
+                    scores[static_cast<std::size_t>(cell.category)] = cell.outside;
+                }
+                close_unary_rules(distance,
+                                  scores.data(),
+                                  [](Rule const& rule) { return rule.lhs; },
+                                  [](Rule const& rule) { return std::get<int>(rule.rhs[0]); });
+                for (auto& cell : span_cells) {
+                    cell.outside = scores[static_cast<std::size_t>(cell.category)];
+                }
+
+                for (auto const& rule : m_rules) {
+                    if (rule.unary or not overlap(distance, rule.bounds)) {
+                        continue;
+                    }
+                    const float parent = scores[static_cast<std::size_t>(rule.lhs)];
+                    if (is_impossible(parent)) {
+                        continue;
+                    }
+                    splits.assign(1, begin);
+                    for_each_split(rule.rhs,
+                                   begin,
+                                   end,
+                                   splits,
+                                   rule.log_prob,
+                                   [&](std::vector<int> const& bounds, float score)
+                                   {
+                                       for (std::size_t i = 0; i < rule.rhs.size(); ++i) {
+                                           if (std::holds_alternative<LetterType>(rule.rhs[i])) {
+                                               continue;
+                                           }
+                                           // Every symbol of a split has an inside score, so a cell.
+                                           if (auto* child = find(bounds[i], bounds[i + 1], std::get<int>(rule.rhs[i])))
+                                           {
+                                               child->outside =
+                                                   log_add(child->outside, parent + score - child->inside);
+                                           }
+                                       }
+                                   });
+                }
+            }
+        }
+        return ParseStatus::Complete;
+    }
+
+  private:
+    auto span_index(int begin, int end) const -> std::size_t
+    {
+        return static_cast<std::size_t>(begin) * static_cast<std::size_t>(m_num_nodes) + static_cast<std::size_t>(end);
+    }
+
+    /**
+     * Add to the scores `cells` of one span what flows along the unary
+     * rules of that span, from `source(rule)` to `target(rule)`, until the
+     * scores settle.  Chains of unary rules can be cyclic, so this stops
+     * after as many rounds as there are categories.
+     */
+    template<typename Source, typename Target>
+    void close_unary_rules(YieldBounds distance, float* cells, Source&& source, Target&& target)
+    {
+        const auto num_categories = static_cast<std::size_t>(m_num_categories);
+        auto& span_base = m_scratch.span_base;
+        auto& span_next = m_scratch.span_next;
+        std::copy(cells, cells + num_categories, span_base.begin());
+
+        for (int round = 0; round < m_num_categories; ++round) {
+            std::copy(span_base.begin(), span_base.end(), span_next.begin());
+            for (auto const& rule : m_rules) {
+                if (not rule.unary or not overlap(distance, rule.bounds)) {
+                    continue;
+                }
+                const float from = cells[static_cast<std::size_t>(source(rule))];
+                if (not is_impossible(from)) {
+                    auto& to = span_next[static_cast<std::size_t>(target(rule))];
+                    to = log_add(to, rule.log_prob + from);
+                }
+            }
+
+            bool changed = false;
+            for (std::size_t i = 0; i < num_categories; ++i) {
+                changed = changed or changed_score(cells[i], span_next[i]);
+                cells[i] = span_next[i];
+            }
+            if (not changed) {
+                return;
+            }
+        }
+    }
+};
+
+}  // namespace
+
+CoarseGrammar::CoarseGrammar(OptimizedGrammar const& grammar, CoarseToFineOptions const& options)
+    : m_log_threshold {options.log_threshold}
+{
+    auto const& fine = grammar.grammar();
+
+    std::map<Nonterminal, int> coarse_ids {};
+    auto coarse_of = [&](Nonterminal const& category)
+    {
+        if (auto iter = m_categories.find(category); iter != m_categories.end()) {
+            return iter->second;
+        }
+        auto [coarse, inserted] = coarse_ids.try_emplace(options.projection(category), m_num_categories);
+        if (inserted) {
+            m_category_bounds.emplace_back();
+            ++m_num_categories;
+        }
+        auto& bounds = m_category_bounds[static_cast<std::size_t>(coarse->second)];
+        bounds = merge_bounds(bounds, fine.yield_bounds(category));
+        m_categories[category] = coarse->second;
+        return coarse->second;
+    };
+
+    m_start = coarse_of(fine.start());
+
+    struct RuleScore
+    {
+        float log_prob;
+        YieldBounds bounds;
+        int id = -1;
+    };
+
+    std::map<std::pair<int, std::vector<Symbol>>, RuleScore> rules {};
+    auto production_rules = std::vector<RuleScore*> {};
+    auto const& productions = fine.productions();
+    for (std::size_t i = 0; i < productions.size(); ++i) {
+        auto const& prod = productions[i];
+        m_production_categories.push_back(coarse_of(prod.lhs));
+        if (prod.rhs.empty()) {
+            production_rules.push_back(nullptr);
+            continue;
+        }
+
+        auto rhs = std::vector<Symbol> {};
+        for (auto const& symbol : prod.rhs) {
+            if (std::holds_alternative<LetterType>(symbol)) {
+                rhs.emplace_back(std::get<LetterType>(symbol));
+            } else {
+                rhs.emplace_back(coarse_of(std::get<Nonterminal>(symbol)));
+            }
+        }
+
+        const float log_prob = std::log(prod.prob);
+        const auto bounds = fine.rhs_yield_bounds()[i].suffixes[0];
+        auto [iter, inserted] =
+            rules.try_emplace({m_production_categories.back(), std::move(rhs)}, RuleScore {log_prob, bounds});
+        if (not inserted) {
+            iter->second.log_prob = std::max(iter->second.log_prob, log_prob);
+            iter->second.bounds = merge_bounds(iter->second.bounds, bounds);
+        }
+        production_rules.push_back(&iter->second);
+    }
+
+    m_rules.reserve(rules.size());
+    for (auto& [key, value] : rules) {
+        value.id = static_cast<int>(m_rules.size());
+        const bool unary = key.second.size() == 1 and std::holds_alternative<int>(key.second[0]);
+        m_rules.push_back({key.first, key.second, value.log_prob, value.bounds, unary});
+    }
+    m_production_rules.reserve(production_rules.size());
+    for (auto const* rule : production_rules) {
+        m_production_rules.push_back(rule == nullptr ? -1 : rule->id);
+    }
+}
+
+auto CoarseGrammar::reweighted(OptimizedGrammar const& grammar) const -> CoarseGrammar
+{
+    auto result = *this;
+    for (auto& rule : result.m_rules) {
+        rule.log_prob = -std::numeric_limits<float>::infinity();
+    }
+
+    auto const& productions = grammar.grammar().productions();
+    for (std::size_t i = 0; i < productions.size(); ++i) {
+        if (m_production_rules[i] < 0) {
+            continue;
+        }
+        auto& rule = result.m_rules[static_cast<std::size_t>(m_production_rules[i])];
+        rule.log_prob = std::max(rule.log_prob, std::log(productions[i].prob));
+    }
+    return result;
+}
+
+auto CoarseGrammar::category(Nonterminal const& fine) const -> int
+{
+    auto iter = m_categories.find(fine);
+    return iter == m_categories.end() ? -1 : iter->second;
+}
+
+auto CoarseGrammar::production_category(std::size_t production) const -> int
+{
+    return m_production_categories[production];
+}
+
+auto CoarseGrammar::prune(Lattice const& lattice,
+                          LetterTrie const& lexicon,
+                          CoarseScratch& scratch,
+                          ParseLimits const& limits) const -> CoarseChart
+{
+    // The span table of the pass counts against the chart budget, so
+    // check that it fits before allocating it.
+    const auto num_nodes = static_cast<std::size_t>(lattice.num_nodes());
+    if (auto status = check_limits(limits, num_nodes * num_nodes); status != ParseStatus::Complete) {
+        return {lattice.num_nodes(), scratch, status};
+    }
+
+    const int final_node = lattice.final_node();
+    auto pass = CoarsePass<Rule> {m_rules, m_category_bounds, lattice, scratch};
+
+    for (int begin = 0; begin < final_node; ++begin) {
+        lexicon.match_paths(lattice,
+                            begin,
+                            [&](int end, Tree const& tree, float path_log_prob)
+                            {
+                                const int coarse = category(tree.symbol());
+                                if (coarse >= 0) {
+                                    pass.add_lexical(begin, end, coarse, tree.log_prob + path_log_prob);
+                                }
+                            });
+    }
+
+    auto status = pass.compute_inside(limits);
+    if (status == ParseStatus::Complete) {
+        status = pass.compute_outside(m_start, limits);
+    }
+    auto& allowed = scratch.allowed;
+    allowed.assign(pass.cells().size(), false);
+    if (status != ParseStatus::Complete) {
+        return {lattice.num_nodes(), scratch, status};
+    }
+
+    // Keep the constituents whose posterior probability, given the
+    // input, reaches the threshold.
+    auto const* root = final_node == 0 ? nullptr : pass.find(0, final_node, m_start);
+    if (root != nullptr) {
+        const float cutoff = root->inside + m_log_threshold;
+        auto const& cells = pass.cells();
+        for (std::size_t i = 0; i < cells.size(); ++i) {
+            allowed[i] = not is_impossible(cells[i].outside) and cells[i].inside + cells[i].outside >= cutoff;
+        }
+    }
+
+    return {lattice.num_nodes(), scratch, ParseStatus::Complete};
+}
+
+}  // namespace parser
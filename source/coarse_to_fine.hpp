@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <variant>
+#include <vector>
+
+#include "grammar_optimizer.hpp"
+#include "lattice.hpp"
+#include "letter_trie.hpp"
+#include "nonterminal.hpp"
+#include "parse_limits.hpp"
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+using CategoryProjection = std::function<Nonterminal(Nonterminal const&)>;
+
+/**
+ * @return a projection that drops everything from the first `separator`
+ * on, e.g. `VerbStem_vC` and `VerbStem_U` both become `VerbStem`.
+ */
+auto strip_suffix_projection(char separator = '_') -> CategoryProjection;
+
+struct CoarseToFineOptions
+{
+    CategoryProjection projection = strip_suffix_projection();
+    // A fine constituent is pruned when the posterior log-probability of
+    // its projection, given the input, is below this threshold.
+    float log_threshold = -15.F;
+};
+
+/**
+ * Buffers of the coarse pass.  A ParseWorkspace keeps them from one parse
+ * to the next; the parse overloads without a workspace use fresh ones on
+ * every call.
+ */
+struct CoarseScratch
+{
+    struct Span
+    {
+        std::uint32_t first = 0;  // offset of its cells in `cells`
+        std::uint32_t size = 0;
+    };
+
+    // A coarse constituent with a derivation, like the cells of a Chart.
+    struct Cell
+    {
+        int category;
+        float inside;
+        float outside;
+    };
+
+    struct LexicalSeed
+    {
+        int begin;
+        int end;
+        int category;
+        float log_prob;
+    };
+
+    std::vector<Span> spans;  // by (begin, end)
+    std::vector<Cell> cells;  // by category within a span
+    std::vector<bool> allowed;  // parallel to cells
+    std::vector<LexicalSeed> seeds;
+    std::vector<int> splits;
+    std::vector<float> span_scores;  // one score per category, for the span being computed
+    std::vector<float> span_base;  // same as span_scores
+    std::vector<float> span_next;  // same as span_scores
+
+    auto reserved_bytes() const -> std::size_t;
+};
+
+/**
+ * The constituents that survived the coarse pass over one input.  Views
+ * the CoarseScratch it was computed in.
+ */
+class CoarseChart
+{
+    int m_num_nodes = 0;
+    CoarseScratch const* m_scratch;
+    ParseStatus m_status = ParseStatus::Complete;
+
+  public:
+    CoarseChart(int num_nodes, CoarseScratch const& scratch, ParseStatus status);
+
+    auto allows(int begin, int end, int category) const -> bool;
+
+    /**
+     * @return whether the coarse pass ran to the end, or which of its
+     * limits stopped it.  A pass that stopped allows nothing.
+     */
+    auto status() const -> ParseStatus;
+};
+
+/**
+ * A grammar over projected categories whose rule probabilities are the
+ * maximum of the fine rules projecting onto them, so that coarse scores
+ * bound the scores of the fine constituents they stand for.
+ */
+class CoarseGrammar
+{
+    using Symbol = std::variant<int, LetterType>;
+
+    struct Rule
+    {
+        int lhs;
+        std::vector<Symbol> rhs;
+        float log_prob;
+        YieldBounds bounds;
+        bool unary;  // the rhs is a single category
+    };
+
+    std::map<Nonterminal, int> m_categories;  // fine category -> coarse category
+    std::vector<YieldBounds> m_category_bounds;  // by coarse category
+    std::vector<int> m_production_categories;  // coarse lhs of each fine production
+    std::vector<Rule> m_rules;
+    std::vector<int> m_production_rules;  // rule of each fine production, or -1
+    int m_num_categories = 0;
+    int m_start = 0;
+    float m_log_threshold = 0.F;
+
+  public:
+    CoarseGrammar(OptimizedGrammar const& grammar, CoarseToFineOptions const& options);
+
+    /**
+     * @return this grammar with its rules scored by the probabilities of
+     * `grammar`, a re-weighting of the grammar it was projected from.
+     */
+    auto reweighted(OptimizedGrammar const& grammar) const -> CoarseGrammar;
+
+    /**
+     * @return the coarse category of a fine one, or -1 if unknown.
+     */
+    auto category(Nonterminal const& fine) const -> int;
+    auto production_category(std::size_t production) const -> int;
+
+    /**
+     * Run the coarse pass over `lattice` and keep the constituents whose
+     * posterior log-probability reaches the threshold.  The pass checks
+     * `limits` before allocating its tables and between spans; each
+     * (begin, end) span and each constituent counts as one entry against
+     * the chart budget.
+     */
+    auto prune(Lattice const& lattice,
+               LetterTrie const& lexicon,
+               CoarseScratch& scratch,
+               ParseLimits const& limits) const -> CoarseChart;
+};
+
+}  // namespace parser
@@ -0,0 +1,309 @@
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "grammar_loader.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+namespace
+{
+
+/**
+ * SAX consumer that builds productions directly from the token stream,
+ * without materializing the document as a DOM.
+ */
+class GrammarSaxHandler
+{
+    enum class ValueType
+    {
+        Number,
+        String,
+        Array,
+        Other,
+    };
+
+    enum class Level
+    {
+        Document,
+        Request,
+        Rules,
+        Rule,
+        Rhs,
+        RhsSymbol,
+        Done,
+    };
+
+    GrammarDocument& m_document;
+
+    Level m_level = Level::Document;
+    bool m_bare_rules = false;
+    int m_skip_depth = 0;  // > 0 while inside a value we do not care about
+    std::string m_key;
+    std::vector<nlohmann::json*> m_captured;  // open containers of a request member
+    std::unordered_map<std::string, Nonterminal> m_names;  // every category seen so far
+
+    // Rule under construction
+    Nonterminal m_lhs;
+    std::vector<LetterProd::RhsType> m_rhs;
+    float m_prob = 1.0F;
+    bool m_has_lhs = false;
+    bool m_has_rhs = false;
+    bool m_has_prob = false;
+    Nonterminal m_rhs_name;
+    bool m_has_rhs_name = false;
+
+    // Store a value of a request member where it belongs.
+    auto store(nlohmann::json value) -> nlohmann::json&
+    {
+        if (m_captured.empty()) {
+            return m_document.attributes[m_key] = std::move(value);
+        }
+        auto& parent = *m_captured.back();
+        if (parent.is_array()) {
+            parent.push_back(std::move(value));
+            return parent.back();
+        }
+        return parent[m_key] = std::move(value);
+    }
+
+    // Each name is turned into a Nonterminal once and copied from then on.
+    auto intern(std::string const& name) -> Nonterminal const&
+    {
+        return m_names.try_emplace(name, name).first->second;
+    }
+
+    // Reject a rule member of the wrong type; other members are ignored.
+    void check_rule_member(ValueType type) const
+    {
+        if (m_key == "lhs" and type != ValueType::String) {
+            throw std::invalid_argument {"Grammar rule \"lhs\" must be a string"};
+        }
+        if (m_key == "rhs" and type != ValueType::Array) {
+            throw std::invalid_argument {"Grammar rule \"rhs\" must be an array"};
+        }
+        if (m_key == "prob" and type != ValueType::Number) {
+            throw std::invalid_argument {"Grammar rule \"prob\" must be a number"};
+        }
+    }
+
+    auto scalar(nlohmann::json value) -> bool
+    {
+        if (m_skip_depth > 0) {
+            return true;
+        }
+        if (not m_captured.empty() or m_level == Level::Request) {
+            store(std::move(value));
+        } else if (m_level == Level::Rule) {
+            check_rule_member(ValueType::Other);
+        } else if (m_level != Level::RhsSymbol) {
+            throw std::invalid_argument {"Unexpected value in grammar: " + value.dump()};
+        }
+        return true;
+    }
+
+    template<typename NumberT>
+    auto number(NumberT value) -> bool
+    {
+        if (m_skip_depth == 0 and m_captured.empty() and m_level == Level::Rule) {
+            check_rule_member(ValueType::Number);
+            if (m_key == "prob") {
+                m_prob = static_cast<float>(value);
+                m_has_prob = true;
+            }
+            return true;
+        }
+        return scalar(value);
+    }
+
+    auto open(bool is_array) -> bool
+    {
+        if (m_skip_depth > 0) {
+            ++m_skip_depth;
+            return true;
+        }
+        if (not m_captured.empty() or (m_level == Level::Request and not(is_array and m_key == "rules"))) {
+            m_captured.push_back(&store(is_array ? nlohmann::json::array() : nlohmann::json::object()));
+            return true;
+        }
+        switch (m_level) {
+            case Level::Document:
+                m_bare_rules = is_array;
+                m_level = is_array ? Level::Rules : Level::Request;
+                return true;
+            case Level::Request:
+                m_level = Level::Rules;
+                return true;
+            case Level::Rules:
+                if (not is_array) {
+                    m_level = Level::Rule;
+                    m_rhs.clear();
+                    m_prob = 1.0F;
+                    m_has_lhs = false;
+                    m_has_rhs = false;
+                    m_has_prob = false;
+                    return true;
+                }
+                throw std::invalid_argument {"Grammar rules must be objects"};
+            case Level::Rule:
+                check_rule_member(is_array ? ValueType::Array : ValueType::Other);
+                if (m_key == "rhs") {
+                    m_level = Level::Rhs;
+                    m_has_rhs = true;
+                    return true;
+                }
+                break;
+            case Level::Rhs:
+                if (not is_array) {
+                    m_level = Level::RhsSymbol;
+                    m_has_rhs_name = false;
+                    return true;
+                }
+                throw std::invalid_argument {"Unexpected array in rule rhs"};
+            default:
+                break;
+        }
+        ++m_skip_depth;
+        return true;
+    }
+
+    auto close() -> bool
+    {
+        if (m_skip_depth > 0) {
+            --m_skip_depth;
+            return true;
+        }
+        if (not m_captured.empty()) {
+            m_captured.pop_back();
+            return true;
+        }
+        switch (m_level) {
+            case Level::Request:
+                m_level = Level::Done;
+                break;
+            case Level::Rules:
+                m_level = m_bare_rules ? Level::Done : Level::Request;
+                break;
+            case Level::Rule:
+                if (not m_has_lhs) {
+                    throw std::invalid_argument {"Grammar rule is missing \"lhs\""};
+                }
+                if (not m_has_rhs) {
+                    throw std::invalid_argument {"Grammar rule is missing \"rhs\""};
+                }
+                if (not m_has_prob) {
+                    throw std::invalid_argument {"Grammar rule is missing \"prob\""};
+                }
+                m_document.productions.emplace_back(std::move(m_lhs), std::move(m_rhs), m_prob);
+                m_rhs = {};
+                m_level = Level::Rules;
+                break;
+            case Level::Rhs:
+                m_level = Level::Rule;
+                break;
+            case Level::RhsSymbol:
+                if (not m_has_rhs_name) {
+                    throw std::invalid_argument {"Nonterminal in rule rhs is missing \"name\""};
+                }
+                m_rhs.emplace_back(std::move(m_rhs_name));
+                m_level = Level::Rhs;
+                break;
+            default:
+                break;
+        }
+        return true;
+    }
+
+  public:
+    explicit GrammarSaxHandler(GrammarDocument& document)
+        : m_document {document}
+    {
+    }
+
+    auto null() -> bool { return scalar(nullptr); }
+
+    auto boolean(bool value) -> bool { return scalar(value); }
+
+    auto number_integer(std::int64_t value) -> bool { return number(value); }
+
+    auto number_unsigned(std::uint64_t value) -> bool { return number(value); }
+
+    auto number_float(double value, std::string const& /*unused*/) -> bool { return number(value); }
+
+    auto string(std::string& value) -> bool
+    {
+        if (m_skip_depth > 0) {
+            return true;
+        }
+        if (m_captured.empty() and m_level == Level::Rule) {
+            check_rule_member(ValueType::String);
+            if (m_key == "lhs") {
+                m_lhs = intern(value);
+                m_has_lhs = true;
+            }
+        } else if (m_level == Level::RhsSymbol and m_key == "name") {
+            m_rhs_name = intern(value);
+            m_has_rhs_name = true;
+        } else if (m_level == Level::Rhs) {
+            if (value.empty()) {
+                throw std::invalid_argument {"Empty terminal in rule rhs"};
+            }
+            m_rhs.emplace_back(value[0]);
+        } else {
+            return scalar(std::move(value));
+        }
+        return true;
+    }
+
+    template<typename BinaryT>
+    auto binary(BinaryT& /*unused*/) -> bool
+    {
+        throw std::invalid_argument {"Unexpected binary value in grammar"};
+    }
+
+    auto start_object(std::size_t /*unused*/) -> bool { return open(false); }
+
+    auto key(std::string& value) -> bool
+    {
+        if (m_skip_depth == 0) {
+            m_key = value;
+        }
+        return true;
+    }
+
+    auto end_object() -> bool { return close(); }
+
+    auto start_array(std::size_t /*unused*/) -> bool { return open(true); }
+
+    auto end_array() -> bool { return close(); }
+
+    auto parse_error(std::size_t /*unused*/,
+                     std::string const& /*unused*/,
+                     nlohmann::json::exception const& error) -> bool
+    {
+        throw std::invalid_argument {error.what()};
+    }
+};
+
+}  // namespace
+
+auto load_grammar(std::istream& input) -> GrammarDocument
+{
+    GrammarDocument document {};
+    GrammarSaxHandler handler {document};
+    nlohmann::json::sax_parse(input, &handler);
+    return document;
+}
+
+}  // namespace parser
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <istream>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+struct GrammarDocument
+{
+    std::vector<LetterProd> productions;
+
+    // Top-level members of a request object other than "rules"
+    // (e.g. "start_symbol", "sentence", "num_trees").
+    nlohmann::json attributes = nlohmann::json::object();
+};
+
+/**
+ * Load grammar rules from `input` in a single streaming pass.
+ *
+ * Accepts either a bare array of rules (the `prods.json` format) or a
+ * request object whose "rules" member holds that array.  Each rule is
+ * an object with "lhs", "rhs" and "prob" members; "rhs" items are
+ * either single-letter strings or objects with a "name" member.
+ */
+auto load_grammar(std::istream& input) -> GrammarDocument;
+
+}  // namespace parser
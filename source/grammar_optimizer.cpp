@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <set>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "grammar_optimizer.hpp"
+
+#include "letter_trie.hpp"
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+#include "tree.h"
+
+namespace parser
+{
+
+namespace
+{
+
+using Rhs = std::vector<LetterProd::RhsType>;
+using LhsIndex = std::map<Nonterminal, std::vector<LetterProd const*>>;
+
+auto index_by_lhs(std::vector<LetterProd> const& productions) -> LhsIndex
+{
+    LhsIndex result {};
+
+    for (auto const& prod : productions) {
+        result[prod.lhs].push_back(&prod);
+    }
+
+    return result;
+}
+
+auto productive_categories(std::vector<LetterProd> const& productions) -> std::set<Nonterminal>
+{
+    std::set<Nonterminal> result {};
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto const& prod : productions) {
+            if (result.contains(prod.lhs)) {
+                continue;
+            }
+            const bool productive = std::all_of(prod.rhs.begin(),
+                                                prod.rhs.end(),
+                                                [&](auto const& symbol)
+                                                {
+                                                    return std::holds_alternative<LetterType>(symbol)
+                                                        or result.contains(std::get<Nonterminal>(symbol));
+                                                });
+            if (productive) {
+                result.insert(prod.lhs);
+                changed = true;
+            }
+        }
+    }
+
+    return result;
+}
+
+auto reachable_categories(Nonterminal const& start, std::vector<LetterProd> const& productions)
+    -> std::set<Nonterminal>
+{
+    auto const lhs_index = index_by_lhs(productions);
+
+    std::set<Nonterminal> result {start};
+    std::vector<Nonterminal> agenda {start};
+
+    while (!agenda.empty()) {
+        auto iter = lhs_index.find(agenda.back());
+        agenda.pop_back();
+        if (iter == lhs_index.end()) {
+            continue;
+        }
+        for (auto const* prod : iter->second) {
+            for (auto const& symbol : prod->rhs) {
+                if (std::holds_alternative<Nonterminal>(symbol)
+                    and result.insert(std::get<Nonterminal>(symbol)).second)
+                {
+                    agenda.push_back(std::get<Nonterminal>(symbol));
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Erase the productions for which `predicate` holds, along with their
+ * entries in the parallel vector `sources`.
+ */
+template<typename Predicate>
+void erase_productions(std::vector<LetterProd>& productions, std::vector<std::size_t>& sources, Predicate predicate)
+{
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < productions.size(); ++i) {
+        if (predicate(productions[i])) {
+            continue;
+        }
+        if (kept != i) {
+            productions[kept] = std::move(productions[i]);
+            sources[kept] = sources[i];
+        }
+        ++kept;
+    }
+    productions.resize(kept);
+    sources.resize(kept);
+}
+
+/**
+ * Keep only the productions whose categories all belong to `keep`.
+ */
+void restrict_to(std::vector<LetterProd>& productions,
+                 std::vector<std::size_t>& sources,
+                 std::set<Nonterminal> const& keep)
+{
+    erase_productions(productions,
+                      sources,
+                      [&](LetterProd const& prod)
+                      {
+                          return not keep.contains(prod.lhs)
+                              or std::any_of(prod.rhs.begin(),
+                                             prod.rhs.end(),
+                                             [&](auto const& symbol)
+                                             {
+                                                 return std::holds_alternative<Nonterminal>(symbol)
+                                                     and not keep.contains(std::get<Nonterminal>(symbol));
+                                             });
+                      });
+}
+
+struct LexicalEntry
+{
+    std::vector<LetterType> letters;
+    Tree tree;
+};
+
+/**
+ * Finds the categories that have a single, non-recursive derivation
+ * and builds the tree of that derivation.
+ */
+class LexiconBuilder
+{
+    LhsIndex const& m_lhs_index;
+    std::map<Nonterminal, std::optional<LexicalEntry>> m_entries;
+
+  public:
+    explicit LexiconBuilder(LhsIndex const& lhs_index)
+        : m_lhs_index {lhs_index}
+    {
+    }
+
+    auto entry(Nonterminal const& category) -> std::optional<LexicalEntry> const&
+    {
+        if (auto iter = m_entries.find(category); iter != m_entries.end()) {
+            return iter->second;
+        }
+        // Stays empty while being computed, so cycles are not lexical.
+        auto& result = m_entries[category];
+
+        auto prods = m_lhs_index.find(category);
+        if (prods == m_lhs_index.end() or prods->second.size() != 1 or prods->second[0]->rhs.empty()) {
+            return result;
+        }
+        auto const& prod = *prods->second[0];
+
+        // Score the tree exactly as the parser would have.
+        auto letters = std::vector<LetterType> {};
+        auto children = std::vector<TreeNode> {};
+        float log_p = std::log(prod.prob);
+        for (auto const& symbol : prod.rhs) {
+            if (std::holds_alternative<LetterType>(symbol)) {
+                letters.push_back(std::get<LetterType>(symbol));
+                children.emplace_back(std::get<LetterType>(symbol));
+                continue;
+            }
+            auto const& child = entry(std::get<Nonterminal>(symbol));
+            if (not child) {
+                return result;
+            }
+            letters.insert(letters.end(), child->letters.begin(), child->letters.end());
+            children.emplace_back(child->tree);
+            log_p += child->tree.log_prob;
+        }
+
+        result = LexicalEntry {std::move(letters), Tree {prod.lhs, std::move(children), log_p}};
+        return result;
+    }
+};
+
+/**
+ * @return `tree` with it and its subtrees scored again, each node with the
+ * probability of the production `sources` maps its category to.
+ */
+auto rescored(Tree const& tree, std::map<Nonterminal, std::size_t> const& sources, std::span<const float> probabilities)
+    -> Tree
+{
+    float log_p = std::log(probabilities[sources.at(tree.symbol())]);
+    auto children = std::vector<TreeNode> {};
+    children.reserve(tree.children().size());
+    for (auto const& child : tree.children()) {
+        if (std::holds_alternative<Tree>(child)) {
+            auto subtree = rescored(std::get<Tree>(child), sources, probabilities);
+            log_p += subtree.log_prob;
+            children.emplace_back(std::move(subtree));
+        } else {
+            children.push_back(child);
+        }
+    }
+    return Tree {tree.symbol(), std::move(children), log_p};
+}
+
+/**
+ * Record in `sources` the production of every category in `tree`.
+ */
+void collect_lexical_sources(Tree const& tree,
+                             LhsIndex const& lhs_index,
+                             std::vector<LetterProd> const& productions,
+                             std::vector<std::size_t> const& sources,
+                             std::map<Nonterminal, std::size_t>& result)
+{
+    auto const* prod = lhs_index.at(tree.symbol())[0];
+    result[tree.symbol()] = sources[static_cast<std::size_t>(prod - productions.data())];
+    for (auto const& child : tree.children()) {
+        if (std::holds_alternative<Tree>(child)) {
+            collect_lexical_sources(std::get<Tree>(child), lhs_index, productions, sources, result);
+        }
+    }
+}
+
+}  // namespace
+
+auto OptimizerOptions::none() -> OptimizerOptions
+{
+    return {false, false, false, false};
+}
+
+OptimizedGrammar::OptimizedGrammar(Pcfg grammar, OptimizerOptions const& options)
+    : m_grammar {std::move(grammar)}
+    , m_num_original_productions {m_grammar.productions().size()}
+{
+    m_sources.resize(m_num_original_productions);
+    std::iota(m_sources.begin(), m_sources.end(), std::size_t {0});
+
+    if (not(options.prune_unproductive or options.prune_unreachable or options.collapse_unary_chains
+            or options.compile_lexicon))
+    {
+        return;
+    }
+
+    auto const start = m_grammar.start();
+    auto productions = m_grammar.productions();
+    auto sources = m_sources;
+    auto lexical_yields = std::map<Nonterminal, YieldBounds> {};
+
+    if (options.prune_unproductive) {
+        auto const productive = productive_categories(productions);
+        restrict_to(productions, sources, productive);
+    }
+    if (options.prune_unreachable) {
+        auto const reachable = reachable_categories(start, productions);
+        restrict_to(productions, sources, reachable);
+    }
+
+    if (options.compile_lexicon) {
+        auto const lhs_index = index_by_lhs(productions);
+        auto builder = LexiconBuilder {lhs_index};
+        auto is_lexical = [&](Nonterminal const& category) { return builder.entry(category).has_value(); };
+
+        // Only the lexical categories used by the rest of the grammar
+        // need to appear in the chart; their insides come with the tree.
+        auto roots = std::set<Nonterminal> {};
+        if (is_lexical(start)) {
+            roots.insert(start);
+        }
+        for (auto const& prod : productions) {
+            if (is_lexical(prod.lhs)) {
+                continue;
+            }
+            for (auto const& symbol : prod.rhs) {
+                if (std::holds_alternative<Nonterminal>(symbol) and is_lexical(std::get<Nonterminal>(symbol))) {
+                    roots.insert(std::get<Nonterminal>(symbol));
+                }
+            }
+        }
+        for (auto const& root : roots) {
+            auto const& entry = *builder.entry(root);
+            collect_lexical_sources(entry.tree, lhs_index, productions, sources, m_lexical_sources);
+            m_lexicon.insert(entry.letters, entry.tree);
+            const int length = static_cast<int>(entry.letters.size());
+            lexical_yields[root] = {length, length};
+        }
+
+        erase_productions(productions, sources, [&](LetterProd const& prod) { return is_lexical(prod.lhs); });
+    }
+
+    if (options.collapse_unary_chains) {
+        std::map<Nonterminal, int> num_prods {};
+        for (auto const& prod : productions) {
+            num_prods[prod.lhs]++;
+        }
+        for (std::size_t i = 0; i < productions.size(); ++i) {
+            auto const& prod = productions[i];
+            if (num_prods[prod.lhs] == 1 and prod.rhs.size() == 1 and is_certain(prod.prob)
+                and std::holds_alternative<Nonterminal>(prod.rhs[0]) and std::get<Nonterminal>(prod.rhs[0]) != prod.lhs)
+            {
+                m_unary_chains[prod.lhs] = std::get<Nonterminal>(prod.rhs[0]);
+                m_chain_sources.push_back(sources[i]);
+            }
+        }
+
+        auto chain_end = [&](Nonterminal const& category)
+        {
+            auto current = category;
+            auto seen = std::set<Nonterminal> {category};
+            for (auto iter = m_unary_chains.find(current); iter != m_unary_chains.end();
+                 iter = m_unary_chains.find(current))
+            {
+                if (not seen.insert(iter->second).second) {
+                    return category;  // cyclic chain, leave it alone
+                }
+                current = iter->second;
+            }
+            return current;
+        };
+
+        auto rewritten = std::vector<Rhs> {};
+        rewritten.reserve(productions.size());
+        for (auto const& prod : productions) {
+            auto& rhs = rewritten.emplace_back();
+            for (auto const& symbol : prod.rhs) {
+                if (std::holds_alternative<Nonterminal>(symbol)) {
+                    rhs.emplace_back(chain_end(std::get<Nonterminal>(symbol)));
+                } else {
+                    rhs.push_back(symbol);
+                }
+            }
+        }
+
+        // A rewritten production must stay distinguishable from every
+        // other one, otherwise its trees could not be restored.
+        bool reverted = true;
+        while (reverted) {
+            reverted = false;
+            std::map<std::pair<Nonterminal, Rhs>, int> num_rewrites {};
+            for (std::size_t i = 0; i < productions.size(); ++i) {
+                num_rewrites[{productions[i].lhs, rewritten[i]}]++;
+            }
+            for (std::size_t i = 0; i < productions.size(); ++i) {
+                if (rewritten[i] != productions[i].rhs and num_rewrites[{productions[i].lhs, rewritten[i]}] > 1) {
+                    rewritten[i] = productions[i].rhs;
+                    reverted = true;
+                }
+            }
+        }
+
+        for (std::size_t i = 0; i < productions.size(); ++i) {
+            if (rewritten[i] != productions[i].rhs) {
+                m_original_rhs[{productions[i].lhs, rewritten[i]}] = std::move(productions[i].rhs);
+                productions[i].rhs = std::move(rewritten[i]);
+            }
+        }
+
+        // Collapsed categories that are no longer used are now unreachable.
+        if (options.prune_unreachable) {
+            auto const reachable = reachable_categories(start, productions);
+            restrict_to(productions, sources, reachable);
+        }
+    }
+
+    m_grammar = Pcfg {start, std::move(productions), lexical_yields};
+    m_sources = std::move(sources);
+}
+
+auto OptimizedGrammar::reweighted(std::span<const float> probabilities) const -> OptimizedGrammar
+{
+    if (probabilities.size() != m_num_original_productions) {
+        throw std::invalid_argument {"Expected one probability per production of the original grammar"};
+    }
+    for (auto source : m_chain_sources) {
+        if (not is_certain(probabilities[source])) {
+            throw std::invalid_argument {"Cannot re-weight a unary chain that was collapsed; rebuild the grammar"};
+        }
+    }
+
+    auto result = *this;
+    auto optimized = std::vector<float> {};
+    optimized.reserve(m_sources.size());
+    for (auto source : m_sources) {
+        optimized.push_back(probabilities[source]);
+    }
+    result.m_grammar = m_grammar.reweighted(optimized);
+    result.m_lexicon.update_trees([&](Tree& tree) { tree = rescored(tree, m_lexical_sources, probabilities); });
+    return result;
+}
+
+auto OptimizedGrammar::grammar() const -> Pcfg const&
+{
+    return m_grammar;
+}
+
+auto OptimizedGrammar::lexicon() const -> LetterTrie const&
+{
+    return m_lexicon;
+}
+
+auto OptimizedGrammar::elided_categories(Nonterminal const& lhs, Rhs const& rhs) const
+    -> std::vector<std::vector<Nonterminal>>
+{
+    auto original = m_original_rhs.find({lhs, rhs});
+    if (original == m_original_rhs.end()) {
+        return {};
+    }
+
+    auto result = std::vector<std::vector<Nonterminal>>(rhs.size());
+    for (std::size_t i = 0; i < rhs.size(); ++i) {
+        if (original->second[i] == rhs[i]) {
+            continue;
+        }
+        for (auto category = std::get<Nonterminal>(original->second[i]); category != std::get<Nonterminal>(rhs[i]);
+             category = m_unary_chains.at(category))
+        {
+            result[i].push_back(category);
+        }
+    }
+    return result;
+}
+
+auto OptimizedGrammar::restore(Tree const& tree) const -> Tree
+{
+    if (m_original_rhs.empty()) {
+        return tree;
+    }
+    auto result = restored(tree);
+    return result ? std::move(*result) : tree;
+}
+
+auto OptimizedGrammar::restored(Tree const& tree) const -> std::optional<Tree>
+{
+    auto rhs = Rhs {};
+    auto children = std::vector<TreeNode> {};
+    bool changed = false;
+    rhs.reserve(tree.children().size());
+    children.reserve(tree.children().size());
+    for (auto const& child : tree.children()) {
+        if (std::holds_alternative<Tree>(child)) {
+            rhs.emplace_back(std::get<Tree>(child).symbol());
+            auto restored_child = restored(std::get<Tree>(child));
+            changed = changed or restored_child.has_value();
+            children.emplace_back(restored_child ? std::move(*restored_child) : std::get<Tree>(child));
+        } else {
+            rhs.emplace_back(std::get<LetterType>(child));
+            children.push_back(child);
+        }
+    }
+
+    auto const elided = elided_categories(tree.symbol(), rhs);
+    if (not changed and elided.empty()) {
+        // Keep sharing the subtree with the tree it was built from.
+        return std::nullopt;
+    }
+    for (std::size_t i = 0; i < elided.size(); ++i) {
+        // Re-insert the elided categories; each one had probability 1.
+        for (auto iter = elided[i].rbegin(); iter != elided[i].rend(); ++iter) {
+            const float log_prob = std::get<Tree>(children[i]).log_prob;
+            auto wrapped = std::vector<TreeNode> {};
+            wrapped.push_back(std::move(children[i]));
+            children[i] = Tree {*iter, std::move(wrapped), log_prob};
+        }
+    }
+
+    return Tree {tree.symbol(), std::move(children), tree.log_prob};
+}
+
+}  // namespace parser
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "letter_trie.hpp"
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+#include "tree.h"
+
+namespace parser
+{
+
+struct OptimizerOptions
+{
+    // Remove categories that can never derive a terminal string.
+    bool prune_unproductive = true;
+    // Remove categories that cannot be reached from the start symbol.
+    bool prune_unreachable = true;
+    // Replace occurrences of `A` by `B` when `A -> B` is the only
+    // production of `A` and has probability 1, up to rounding.
+    bool collapse_unary_chains = true;
+    // Take categories that deterministically spell out a single string
+    // out of the grammar and propose them directly from a letter trie.
+    bool compile_lexicon = true;
+
+    static auto none() -> OptimizerOptions;
+};
+
+/**
+ * A grammar preprocessed for parsing, together with what is needed to
+ * restore trees built from it to the shape of the original grammar.
+ */
+class OptimizedGrammar
+{
+    using Rhs = std::vector<LetterProd::RhsType>;
+
+    Pcfg m_grammar;
+    LetterTrie m_lexicon;
+
+    // Deterministic unary productions that were collapsed, `A -> B`.
+    std::map<Nonterminal, Nonterminal> m_unary_chains;
+    // (lhs, rewritten rhs) -> original rhs
+    std::map<std::pair<Nonterminal, Rhs>, Rhs> m_original_rhs;
+
+    // Where the probabilities come from, as indices of original productions.
+    std::size_t m_num_original_productions = 0;
+    std::vector<std::size_t> m_sources;  // parallel to the productions of m_grammar
+    std::map<Nonterminal, std::size_t> m_lexical_sources;  // by category of the lexicon trees
+    std::vector<std::size_t> m_chain_sources;  // the collapsed unary productions
+
+  public:
+    explicit OptimizedGrammar(Pcfg grammar, OptimizerOptions const& options = {});
+
+    /**
+     * @return this grammar with the probability of the i-th production of
+     * the original grammar replaced by `probabilities[i]`, keeping the
+     * structure found by the optimizer.
+     *
+     * @throws std::invalid_argument if a collapsed unary chain would no
+     * longer have probability 1, which changes the structure.
+     */
+    auto reweighted(std::span<const float> probabilities) const -> OptimizedGrammar;
+
+    auto grammar() const -> Pcfg const&;
+    auto lexicon() const -> LetterTrie const&;
+
+    /**
+     * @return for each symbol of the production `lhs -> rhs` of the
+     * optimized grammar, the categories that unary chain collapsing
+     * elided above it, outermost first; empty if nothing was elided.
+     */
+    auto elided_categories(Nonterminal const& lhs, Rhs const& rhs) const -> std::vector<std::vector<Nonterminal>>;
+
+    /**
+     * @return `tree` with the categories elided by unary chain
+     * collapsing put back in place.  Subtrees where nothing was elided
+     * are shared with `tree`.
+     */
+    auto restore(Tree const& tree) const -> Tree;
+
+  private:
+    /**
+     * @return the restored tree, or nothing if it is `tree` unchanged.
+     */
+    auto restored(Tree const& tree) const -> std::optional<Tree>;
+};
+
+}  // namespace parser
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "grammar_registry.hpp"
+
+#include "coarse_to_fine.hpp"
+#include "grammar_optimizer.hpp"
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+#include "viterbiparser.h"
+
+namespace parser
+{
+
+GrammarRegistry::GrammarRegistry(Nonterminal start,
+                                 std::vector<LetterProd> productions,
+                                 OptimizerOptions const& options,
+                                 std::optional<CoarseToFineOptions> const& coarse_to_fine)
+    : m_start {std::move(start)}
+    , m_options {options}
+    , m_coarse_to_fine {coarse_to_fine}
+{
+    load(std::move(productions));
+}
+
+static_assert(std::atomic<std::shared_ptr<const GrammarSnapshot> const*>::is_always_lock_free);
+static_assert(std::atomic<std::size_t>::is_always_lock_free);
+
+auto GrammarRegistry::snapshot() const -> std::shared_ptr<const GrammarSnapshot>
+{
+    // While counted, the reference we load cannot be reclaimed.
+    m_readers.fetch_add(1);
+    auto result = *m_active.load();
+    m_readers.fetch_sub(1);
+    return result;
+}
+
+void GrammarRegistry::publish(GrammarSnapshot snapshot)
+{
+    m_published.push_back(
+        std::make_unique<const Reference>(std::make_shared<const GrammarSnapshot>(std::move(snapshot))));
+    m_active.store(m_published.back().get());
+
+    // A parse that enters snapshot() from now on loads the new reference,
+    // so with none inside, the older ones are unreachable.
+    if (m_readers.load() == 0) {
+        m_published.erase(m_published.begin(), m_published.end() - 1);
+    }
+}
+
+void GrammarRegistry::load(std::vector<LetterProd> productions)
+{
+    auto lock = std::lock_guard {m_update};
+    auto parser = ViterbiParser {Pcfg {m_start, productions}, m_options, m_coarse_to_fine};
+
+    const auto version = m_published.empty() ? 0 : (*m_published.back())->version + 1;
+    publish(GrammarSnapshot {std::move(productions), std::move(parser), version});
+}
+
+void GrammarRegistry::reweight(std::vector<LetterProd> productions)
+{
+    auto lock = std::lock_guard {m_update};
+    auto const& active = *m_published.back();
+
+    auto const same_shape = std::equal(productions.begin(),
+                                       productions.end(),
+                                       active->productions.begin(),
+                                       active->productions.end(),
+                                       [](LetterProd const& lhs, LetterProd const& rhs)
+                                       { return lhs.lhs == rhs.lhs and lhs.rhs == rhs.rhs; });
+    if (not same_shape) {
+        throw std::invalid_argument {"Re-weighted productions must match the active ones"};
+    }
+
+    auto probabilities = std::vector<float> {};
+    probabilities.reserve(productions.size());
+    for (auto const& prod : productions) {
+        probabilities.push_back(prod.prob);
+    }
+    auto parser = active->parser.reweighted(probabilities);
+
+    publish(GrammarSnapshot {std::move(productions), std::move(parser), active->version + 1});
+}
+
+}  // namespace parser
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "coarse_to_fine.hpp"
+#include "grammar_optimizer.hpp"
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+#include "viterbiparser.h"
+
+namespace parser
+{
+
+/**
+ * A parser together with the productions it was built from.  Snapshots
+ * never change once published, so any number of parses can share one.
+ */
+struct GrammarSnapshot
+{
+    std::vector<LetterProd> productions;
+    ViterbiParser parser;
+    std::uint64_t version;
+};
+
+/**
+ * Holds the active grammar of a long-running process and lets it be
+ * replaced while parses are running.
+ *
+ * Parses take the active snapshot through a lock-free atomic pointer and
+ * keep it for as long as they need it.  Updates build the next snapshot
+ * on the calling thread, then publish it with one atomic store, so
+ * parses never wait for a reload to finish.
+ *
+ * Replaced snapshots are reclaimed RCU-style: the registry drops its own
+ * references to them at a later update that sees no parse in the middle
+ * of `snapshot()`, after which none can reach them through the pointer.
+ * A snapshot is freed when the last parse holding it lets go.
+ */
+class GrammarRegistry
+{
+    Nonterminal m_start;
+    OptimizerOptions m_options;
+    std::optional<CoarseToFineOptions> m_coarse_to_fine;
+
+    using Reference = std::shared_ptr<const GrammarSnapshot>;
+
+    std::mutex m_update;  // serializes updates; parses never take it
+    // The references published so far and not reclaimed yet; the last
+    // one is active.  Guarded by `m_update`.
+    std::vector<std::unique_ptr<const Reference>> m_published;
+    std::atomic<Reference const*> m_active {nullptr};
+    mutable std::atomic<std::size_t> m_readers {0};  // parses inside `snapshot()`
+
+  public:
+    GrammarRegistry(Nonterminal start,
+                    std::vector<LetterProd> productions,
+                    OptimizerOptions const& options = {},
+                    std::optional<CoarseToFineOptions> const& coarse_to_fine = std::nullopt);
+
+    auto snapshot() const -> std::shared_ptr<const GrammarSnapshot>;
+
+    /**
+     * Build a parser for `productions` and make it the active one.
+     */
+    void load(std::vector<LetterProd> productions);
+
+    /**
+     * Make the active parser use the probabilities of `productions`,
+     * without building its structure again.
+     *
+     * @throws std::invalid_argument if `productions` differ from those of
+     * the active snapshot in anything but their probabilities, or if the
+     * new probabilities change the optimized grammar; use `load()` then.
+     */
+    void reweight(std::vector<LetterProd> productions);
+
+  private:
+    void publish(GrammarSnapshot snapshot);
+};
+
+}  // namespace parser
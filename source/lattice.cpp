@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lattice.hpp"
+
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+Lattice::Lattice(int num_nodes, std::vector<LatticeEdge> edges)
+    : m_num_nodes {num_nodes}
+    , m_edges {std::move(edges)}
+{
+    if (m_num_nodes < 1) {
+        throw std::invalid_argument {"A lattice needs at least one node"};
+    }
+
+    std::stable_sort(
+        m_edges.begin(), m_edges.end(), [](auto const& lhs, auto const& rhs) { return lhs.from < rhs.from; });
+
+    for (auto const& edge : m_edges) {
+        if (edge.from < 0 or edge.to >= m_num_nodes or edge.from >= edge.to) {
+            throw std::invalid_argument {"Lattice edge " + std::to_string(edge.from) + " -> "
+                                         + std::to_string(edge.to) + " does not go forward"};
+        }
+        auto [iter, inserted] = m_letters.try_emplace({edge.from, edge.to, edge.letter}, edge.log_prob);
+        if (not inserted) {
+            iter->second = std::max(iter->second, edge.log_prob);
+        }
+    }
+
+    // Edges are sorted by their source, which comes before their target,
+    // so one sweep per source node settles every distance from it.
+    auto const num = static_cast<std::size_t>(m_num_nodes);
+    m_distances.resize(num * num);
+    for (std::size_t from = 0; from < num; ++from) {
+        auto* row = &m_distances[from * num];
+        row[from] = {0, 0};
+        for (auto const& edge : m_edges) {
+            auto const& via = row[static_cast<std::size_t>(edge.from)];
+            if (via.min > via.max) {
+                continue;
+            }
+            auto& target = row[static_cast<std::size_t>(edge.to)];
+            target = {std::min(target.min, via.min + 1), std::max(target.max, via.max + 1)};
+        }
+    }
+}
+
+auto Lattice::from_letters(std::span<const LetterType> letters) -> Lattice
+{
+    std::vector<LatticeEdge> edges {};
+    edges.reserve(letters.size());
+
+    int index = 0;
+    for (auto letter : letters) {
+        edges.push_back({index, index + 1, letter});
+        index++;
+    }
+
+    return {index + 1, std::move(edges)};
+}
+
+auto Lattice::num_nodes() const -> int
+{
+    return m_num_nodes;
+}
+
+auto Lattice::final_node() const -> int
+{
+    return m_num_nodes - 1;
+}
+
+auto Lattice::edges() const -> std::vector<LatticeEdge> const&
+{
+    return m_edges;
+}
+
+auto Lattice::edges_from(int node) const -> std::span<const LatticeEdge>
+{
+    auto first = std::lower_bound(
+        m_edges.begin(), m_edges.end(), node, [](auto const& edge, int value) { return edge.from < value; });
+    auto last = std::upper_bound(
+        first, m_edges.end(), node, [](int value, auto const& edge) { return value < edge.from; });
+    return {first, last};
+}
+
+auto Lattice::letter(int from, int to, LetterType letter) const -> std::optional<float>
+{
+    auto iter = m_letters.find({from, to, letter});
+    if (iter == m_letters.end()) {
+        return std::nullopt;
+    }
+    return iter->second;
+}
+
+auto Lattice::distance(int from, int to) const -> YieldBounds
+{
+    return m_distances[static_cast<std::size_t>(from) * static_cast<std::size_t>(m_num_nodes)
+                       + static_cast<std::size_t>(to)];
+}
+
+}  // namespace parser
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <map>
+#include <optional>
+#include <span>
+#include <tuple>
+#include <vector>
+
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+struct LatticeEdge
+{
+    int from;
+    int to;
+    LetterType letter;
+    float log_prob = 0.F;
+};
+
+/**
+ * A DAG of weighted letters between integer positions.  Nodes are
+ * numbered so that every edge goes forward; parses span from node 0
+ * to the last node.
+ */
+class Lattice
+{
+    int m_num_nodes;
+    std::vector<LatticeEdge> m_edges;  // sorted by `from`
+    std::map<std::tuple<int, int, LetterType>, float> m_letters;  // best log-probability of each letter edge
+    std::vector<YieldBounds> m_distances;  // number of letters on the paths between two nodes
+
+  public:
+    Lattice(int num_nodes, std::vector<LatticeEdge> edges);
+
+    static auto from_letters(std::span<const LetterType> letters) -> Lattice;
+
+    auto num_nodes() const -> int;
+    auto final_node() const -> int;
+    auto edges() const -> std::vector<LatticeEdge> const&;
+
+    /**
+     * @return the edges leaving `node`.
+     */
+    auto edges_from(int node) const -> std::span<const LatticeEdge>;
+
+    /**
+     * @return the log-probability of the best `letter` edge between
+     * `from` and `to`, if there is one.
+     */
+    auto letter(int from, int to, LetterType letter) const -> std::optional<float>;
+
+    /**
+     * @return the shortest and longest path between two nodes, in
+     * letters; empty bounds if `to` cannot be reached from `from`.
+     */
+    auto distance(int from, int to) const -> YieldBounds;
+};
+
+}  // namespace parser
@@ -0,0 +1,34 @@
+#include <cstddef>
+#include <span>
+#include <utility>
+
+#include "letter_trie.hpp"
+
+#include "pcfg.hpp"
+#include "tree.h"
+
+namespace parser
+{
+
+void LetterTrie::insert(std::span<const LetterType> letters, Tree tree)
+{
+    std::size_t node = 0;
+    for (auto letter : letters) {
+        auto iter = m_nodes[node].children.find(letter);
+        if (iter == m_nodes[node].children.end()) {
+            m_nodes[node].children[letter] = m_nodes.size();
+            node = m_nodes.size();
+            m_nodes.emplace_back();
+        } else {
+            node = iter->second;
+        }
+    }
+    m_nodes[node].trees.push_back(std::move(tree));
+}
+
+auto LetterTrie::empty() const -> bool
+{
+    return m_nodes.size() == 1;
+}
+
+}  // namespace parser
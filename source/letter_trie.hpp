@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <span>
+#include <vector>
+
+#include "lattice.hpp"
+#include "pcfg.hpp"
+#include "tree.h"
+
+namespace parser
+{
+
+/**
+ * A trie over letter strings whose nodes hold the complete trees of the
+ * lexical categories that spell out exactly that string.
+ */
+class LetterTrie
+{
+    struct Node
+    {
+        std::map<LetterType, std::size_t> children;
+        std::vector<Tree> trees;
+    };
+
+    std::vector<Node> m_nodes {Node {}};  // m_nodes[0] is the root
+
+  public:
+    void insert(std::span<const LetterType> letters, Tree tree);
+
+    auto empty() const -> bool;
+
+    /**
+     * Call `callback(tree)` on every tree, which it may rescore or replace.
+     */
+    template<typename Callback>
+    void update_trees(Callback&& callback)
+    {
+        for (auto& node : m_nodes) {
+            for (auto& tree : node.trees) {
+                callback(tree);
+            }
+        }
+    }
+
+    /**
+     * Call `callback(end, tree, log_prob)` for every tree spelled along a
+     * path of `lattice` from `begin` to `end`, where `log_prob` is the sum
+     * of the weights of the path's edges.
+     */
+    template<typename Callback>
+    void match_paths(Lattice const& lattice, int begin, Callback&& callback) const
+    {
+        match_from(lattice, 0, begin, 0.F, callback);
+    }
+
+  private:
+    template<typename Callback>
+    void match_from(Lattice const& lattice, std::size_t node, int position, float log_prob, Callback& callback) const
+    {
+        for (auto const& edge : lattice.edges_from(position)) {
+            auto iter = m_nodes[node].children.find(edge.letter);
+            if (iter == m_nodes[node].children.end()) {
+                continue;
+            }
+            for (auto const& tree : m_nodes[iter->second].trees) {
+                callback(edge.to, tree, log_prob + edge.log_prob);
+            }
+            match_from(lattice, iter->second, edge.to, log_prob + edge.log_prob, callback);
+        }
+    }
+};
+
+}  // namespace parser
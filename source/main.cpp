@@ -1,13 +1,22 @@
 #include <chrono>
+#include <cstddef>
 #include <exception>
 #include <iostream>
+#include <optional>
 #include <string>
-#include <variant>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <nlohmann/json.hpp>
 
+#include "coarse_to_fine.hpp"
+#include "grammar_loader.hpp"
+#include "grammar_optimizer.hpp"
+#include "lattice.hpp"
 #include "nonterminal.hpp"
+#include "parse_limits.hpp"
+#include "parse_workspace.hpp"
 #include "pcfg.hpp"
 #include "viterbiparser.h"
 
@@ -15,48 +24,71 @@ void parse_from_stream(std::istream& istream)
 {
     using Symb = parser::Nonterminal;
 
-    auto start_time = std::chrono::high_resolution_clock::now();
+    auto start_time = std::chrono::steady_clock::now();
 
-    const auto input = nlohmann::json::parse(istream);
+    auto document = parser::load_grammar(istream);
+    auto const& input = document.attributes;
 
-    std::vector<parser::LetterProd> productions {};
-    for (auto&& rule : input["rules"]) {
-        auto lhs = rule["lhs"].get<std::string>();
-        auto prob = rule["prob"].get<float>();
-        auto rhs = std::vector<std::variant<parser::Nonterminal, parser::LetterType>> {};
-        for (auto&& item : rule["rhs"]) {
-            if (item.is_object()) {
-                rhs.emplace_back(Symb(item["name"].get<std::string>()));
-            } else {
-                rhs.emplace_back(item.get<std::string>()[0]);
-            }
-        }
-        productions.push_back({Symb(lhs), rhs, prob});
+    const auto start_symbol = input.at("start_symbol").get<std::string>();
+    const auto options =
+        input.value("optimize_grammar", false) ? parser::OptimizerOptions {} : parser::OptimizerOptions::none();
+    auto coarse_to_fine = std::optional<parser::CoarseToFineOptions> {};
+    if (input.contains("coarse_to_fine_threshold")) {
+        coarse_to_fine.emplace();
+        coarse_to_fine->log_threshold = input.at("coarse_to_fine_threshold").get<float>();
     }
+    const auto parser = parser::ViterbiParser(
+        parser::Pcfg(Symb(start_symbol), std::move(document.productions)), options, coarse_to_fine);
 
-    const auto start_symbol = input["start_symbol"].get<std::string>();
-    const auto parser = parser::ViterbiParser(parser::Pcfg(Symb(start_symbol), productions));
+    auto lattice = std::optional<parser::Lattice> {};
+    if (input.contains("lattice")) {
+        auto edges = std::vector<parser::LatticeEdge> {};
+        for (auto const& edge : input.at("lattice").at("edges")) {
+            edges.push_back({edge.at("from").get<int>(),
+                             edge.at("to").get<int>(),
+                             edge.at("letter").get<std::string>().at(0),
+                             edge.value("log_prob", 0.F)});
+        }
+        lattice.emplace(input.at("lattice").at("num_nodes").get<int>(), std::move(edges));
+    } else {
+        std::vector<char> tokens {};
+        for (const char chr : input.at("sentence").get<std::string>()) {
+            tokens.push_back(chr);
+        }
+        lattice = parser::Lattice::from_letters(tokens);
+    }
 
-    std::vector<char> tokens {};
-    for (const char chr : input["sentence"].get<std::string>()) {
-        tokens.push_back(chr);
+    // The timeout counts from the start of the request, grammar loading included.
+    auto limits = parser::ParseLimits {};
+    if (input.contains("timeout_ms")) {
+        limits.deadline = start_time + std::chrono::milliseconds {input.at("timeout_ms").get<long>()};
+    }
+    if (input.contains("max_chart_entries")) {
+        limits.max_chart_entries = input.at("max_chart_entries").get<std::size_t>();
     }
 
-    auto trees = parser.parse(tokens, input["num_trees"].get<int>());
+    auto result = nlohmann::json {};
+    auto workspace = parser::ParseWorkspace {};
+    if (input.value("packed_forest", false)) {
+        result["forest"] = parser.parse_forest(*lattice, workspace, limits).json();
+    } else {
+        std::unordered_set<parser::Tree> trees {};
+        for (auto const& ref : parser.parse(*lattice, workspace, input.at("num_trees").get<int>(), limits)) {
+            trees.insert(parser.tree(workspace, ref));
+        }
 
-    auto json_trees = std::vector<nlohmann::json> {};
-    for (auto&& tree : trees) {
-        json_trees.push_back(tree.json());
+        auto json_trees = std::vector<nlohmann::json> {};
+        for (auto&& tree : trees) {
+            json_trees.push_back(tree.json());
+        }
+        result["trees"] = json_trees;
     }
+    result["status"] = parser::to_string(workspace.status());
 
-    auto end_time = std::chrono::high_resolution_clock::now();
+    auto end_time = std::chrono::steady_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+    result["elapsed_ms"] = elapsed.count();
 
-    auto result = nlohmann::json {
-        {"status", "success"},
-        {"elapsed_ms", elapsed.count()},
-        {"trees", json_trees},
-    };
     std::cout << result.dump() << "\n";
 }
 
@@ -11,7 +11,7 @@ Nonterminal::Nonterminal(std::string name)
 {
 }
 
-auto Nonterminal::name() const -> std::string
+auto Nonterminal::name() const -> std::string const&
 {
     return m_name;
 }
@@ -21,4 +21,9 @@ auto Nonterminal::operator<(const Nonterminal& other) const -> bool
     return m_name < other.m_name;
 }
 
+auto Nonterminal::operator==(const Nonterminal& other) const -> bool
+{
+    return m_name == other.m_name;
+}
+
 }  // namespace parser
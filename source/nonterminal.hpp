@@ -24,9 +24,11 @@ class Nonterminal
 
     ~Nonterminal() = default;
 
-    auto name() const -> std::string;
+    auto name() const -> std::string const&;
 
     auto operator<(Nonterminal const& other) const -> bool;
+
+    auto operator==(Nonterminal const& other) const -> bool;
 };
 
 }  // namespace parser
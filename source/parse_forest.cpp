@@ -0,0 +1,56 @@
+#include <cstddef>
+#include <map>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "parse_forest.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+auto ParseForest::empty() const -> bool
+{
+    return nodes.empty();
+}
+
+auto ParseForest::json() const -> nlohmann::json
+{
+    auto labels = nlohmann::json::array();
+    auto label_ids = std::map<Nonterminal, std::size_t> {};
+    auto json_nodes = nlohmann::json::array();
+
+    for (auto const& node : nodes) {
+        auto [label, inserted] = label_ids.try_emplace(node.symbol, labels.size());
+        if (inserted) {
+            labels.push_back(node.symbol.name());
+        }
+
+        auto derivations = nlohmann::json::array();
+        for (auto const& derivation : node.derivations) {
+            auto children = nlohmann::json::array();
+            for (auto const& child : derivation.children) {
+                if (std::holds_alternative<std::size_t>(child)) {
+                    children.push_back(std::get<std::size_t>(child));
+                } else {
+                    children.push_back(std::string {std::get<LetterType>(child)});
+                }
+            }
+            derivations.push_back({derivation.log_prob, std::move(children)});
+        }
+
+        json_nodes.push_back({label->second, node.begin, node.end, node.log_prob, std::move(derivations)});
+    }
+
+    return nlohmann::json {
+        {"labels", std::move(labels)},
+        {"nodes", std::move(json_nodes)},
+    };
+}
+
+}  // namespace parser
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <variant>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "nonterminal.hpp"
+#include "pcfg.hpp"
+
+namespace parser
+{
+
+using ForestChild = std::variant<std::size_t, LetterType>;  // index of a node, or a letter
+
+struct ForestDerivation
+{
+    // Inside score: the log-probability of the best subtree rooted at the
+    // node that starts with this derivation, letters' lattice weights
+    // included.  Scores outside the node's span are not counted.
+    float log_prob = 0.F;
+    std::vector<ForestChild> children;
+};
+
+/**
+ * All the ways of deriving `symbol` over the lattice nodes from `begin`
+ * to `end`.
+ */
+struct ForestNode
+{
+    Nonterminal symbol;
+    int begin = 0;
+    int end = 0;
+    float log_prob = 0.F;  // inside score of the best subtree rooted here
+    std::vector<ForestDerivation> derivations;
+};
+
+/**
+ * A packed parse forest: every constituent of a parse appears once, and
+ * trees that share it share its node.  Unary cycles make it a graph
+ * rather than a DAG.
+ */
+struct ParseForest
+{
+    std::vector<ForestNode> nodes;  // nodes[0] is the root, if there is a parse
+
+    auto empty() const -> bool;
+
+    /**
+     * Encode the forest as
+     * `{"labels": [symbol, ...], "nodes": [[label, begin, end, log_prob, derivations], ...]}`
+     * where each derivation is `[log_prob, [child, ...]]` and each child
+     * is either a node index or a one-letter string.
+     */
+    auto json() const -> nlohmann::json;
+};
+
+}  // namespace parser
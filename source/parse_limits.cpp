@@ -0,0 +1,50 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string_view>
+
+#include "parse_limits.hpp"
+
+namespace parser
+{
+
+void CancellationToken::cancel() const
+{
+    m_cancelled->store(true, std::memory_order_relaxed);
+}
+
+auto CancellationToken::cancelled() const -> bool
+{
+    return m_cancelled->load(std::memory_order_relaxed);
+}
+
+auto check_limits(ParseLimits const& limits, std::size_t num_entries) -> ParseStatus
+{
+    if (limits.cancellation and limits.cancellation->cancelled()) {
+        return ParseStatus::Cancelled;
+    }
+    if (limits.max_chart_entries and num_entries > *limits.max_chart_entries) {
+        return ParseStatus::BudgetExceeded;
+    }
+    if (limits.deadline and std::chrono::steady_clock::now() >= *limits.deadline) {
+        return ParseStatus::DeadlineExceeded;
+    }
+    return ParseStatus::Complete;
+}
+
+auto to_string(ParseStatus status) -> std::string_view
+{
+    switch (status) {
+        case ParseStatus::Complete:
+            return "success";
+        case ParseStatus::DeadlineExceeded:
+            return "deadline_exceeded";
+        case ParseStatus::Cancelled:
+            return "cancelled";
+        case ParseStatus::BudgetExceeded:
+            return "budget_exceeded";
+    }
+    return "unknown";
+}
+
+}  // namespace parser
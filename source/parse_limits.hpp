@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+namespace parser
+{
+
+/**
+ * Lets one thread ask a parse running in another to stop.  Copies share
+ * the same flag, so a worker can hand a copy to the parse and keep one.
+ */
+class CancellationToken
+{
+    std::shared_ptr<std::atomic<bool>> m_cancelled = std::make_shared<std::atomic<bool>>(false);
+
+  public:
+    void cancel() const;
+    auto cancelled() const -> bool;
+};
+
+/**
+ * Bounds on the work a single parse may do.  They are checked between
+ * spans of the coarse pass and of the chart, and between the nodes of a
+ * parse forest, so a parse overruns them by at most one span.
+ */
+struct ParseLimits
+{
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    std::optional<CancellationToken> cancellation;
+    // Maximum number of constituents (chart edges) plus (begin, end)
+    // spans the chart or the coarse pass may hold, and of derivations
+    // (hyperedges) a parse forest may hold.
+    std::optional<std::size_t> max_chart_entries;
+};
+
+enum class ParseStatus
+{
+    Complete,
+    DeadlineExceeded,
+    Cancelled,
+    BudgetExceeded,
+};
+
+/**
+ * @return which of `limits` a parse that has built `num_entries` chart
+ * entries or forest derivations has run into, or `Complete` if none.
+ */
+auto check_limits(ParseLimits const& limits, std::size_t num_entries) -> ParseStatus;
+
+/**
+ * @return the name of `status` as parser_exe reports it.
+ */
+auto to_string(ParseStatus status) -> std::string_view;
+
+}  // namespace parser
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chart.hpp"
+#include "coarse_to_fine.hpp"
+#include "parse_limits.hpp"
+#include "tree.h"
+
+namespace parser
+{
+
+class ViterbiParser;
+
+/**
+ * A complete parse left in a ParseWorkspace by `ViterbiParser::parse`.
+ */
+struct ParseRef
+{
+    std::uint32_t entry;  // in the workspace's chart
+    float log_prob;
+};
+
+/**
+ * Storage that a ViterbiParser reuses from one parse to the next: the
+ * chart and its arena of constituents, the coarse pass and scratch
+ * buffers.  Buffers only grow, up to what the inputs parsed so far
+ * needed, so parsing an input the workspace was warmed up on does not
+ * allocate.  Starting a new parse empties it in constant time.
+ *
+ * A workspace is not thread-safe; give each thread its own.
+ */
+class ParseWorkspace
+{
+    friend class ViterbiParser;
+
+    struct LexicalSeed
+    {
+        int begin;
+        int end;
+        int category;
+        Tree const* tree;
+        float log_prob;
+    };
+
+    Chart m_chart;
+    CoarseScratch m_coarse;
+    std::vector<LexicalSeed> m_seeds;
+    std::vector<std::uint32_t> m_children;  // children of the candidate being built
+    std::vector<ParseRef> m_results;
+    ParseStatus m_status = ParseStatus::Complete;
+
+  public:
+    /**
+     * @return whether the last parse into this workspace ran to the end,
+     * or which of its limits stopped it.
+     */
+    auto status() const -> ParseStatus { return m_status; }
+
+    /**
+     * @return the bytes held by the buffers of the workspace, which stays
+     * the same while parsing inputs it has grown to fit.
+     */
+    auto reserved_bytes() const -> std::size_t
+    {
+        return m_chart.reserved_bytes() + m_coarse.reserved_bytes() + m_seeds.capacity() * sizeof(LexicalSeed)
+            + m_children.capacity() * sizeof(std::uint32_t) + m_results.capacity() * sizeof(ParseRef);
+    }
+};
+
+}  // namespace parser
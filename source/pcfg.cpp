@@ -1,5 +1,11 @@
+#include <algorithm>
+#include <cstddef>
 #include <map>
+#include <memory>
+#include <optional>
 #include <set>
+#include <span>
+#include <stdexcept>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -29,25 +35,26 @@ auto calculate_indexes(std::vector<LetterProd> const& productions) -> Indexes
 {
     Indexes result {};
 
-    for (auto const& prod : productions) {
+    for (std::size_t i = 0; i < productions.size(); ++i) {
+        auto const& prod = productions[i];
         if (result.lhs_index.count(prod.lhs) == 0) {
             result.lhs_index[prod.lhs] = {};
         }
-        result.lhs_index[prod.lhs].push_back(prod);
+        result.lhs_index[prod.lhs].push_back(i);
 
         if (prod.rhs.empty()) {
-            result.empty_index[prod.lhs] = prod;
+            result.empty_index[prod.lhs] = i;
         } else {
             auto rhs0 = prod.rhs[0];
             if (result.rhs_index.count(rhs0) == 0) {
                 result.rhs_index[rhs0] = {};
             }
-            result.rhs_index[rhs0].push_back(prod);
+            result.rhs_index[rhs0].push_back(i);
         }
 
         for (auto const& token : prod.rhs) {
             if (std::holds_alternative<LetterType>(token)) {
-                result.lexical_index[std::get<LetterType>(token)].insert(prod);
+                result.lexical_index[std::get<LetterType>(token)].insert(i);
             }
         }
     }
@@ -133,15 +140,176 @@ auto calculate_leftcorners(std::set<Nonterminal> const& categories,
     return result;
 }
 
+auto add_yields(int lhs, int rhs) -> int
+{
+    return lhs > unbounded_yield - rhs ? unbounded_yield : lhs + rhs;
+}
+
+auto add_yields(YieldBounds lhs, YieldBounds rhs) -> YieldBounds
+{
+    return {add_yields(lhs.min, rhs.min), add_yields(lhs.max, rhs.max)};
+}
+
+auto max_yield(Nonterminal const& category,
+               std::vector<LetterProd> const& productions,
+               Indexes const& indexes,
+               std::map<Nonterminal, int> const& min_yields,
+               std::map<Nonterminal, YieldBounds> const& lexical_yields,
+               std::map<Nonterminal, std::optional<int>>& max_yields) -> int
+{
+    if (auto iter = max_yields.find(category); iter != max_yields.end()) {
+        // Still being computed means the category is recursive.
+        return iter->second.value_or(unbounded_yield);
+    }
+    max_yields[category] = std::nullopt;
+
+    int result = 0;
+    if (auto iter = lexical_yields.find(category); iter != lexical_yields.end()) {
+        result = iter->second.max;
+    }
+    if (auto iter = indexes.lhs_index.find(category); iter != indexes.lhs_index.end()) {
+        for (auto index : iter->second) {
+            auto const& prod = productions[index];
+            // Empty and unproductive productions never span anything.
+            const bool productive = std::all_of(prod.rhs.begin(),
+                                                prod.rhs.end(),
+                                                [&](auto const& symbol)
+                                                {
+                                                    return std::holds_alternative<LetterType>(symbol)
+                                                        or min_yields.contains(std::get<Nonterminal>(symbol));
+                                                });
+            if (prod.rhs.empty() or not productive) {
+                continue;
+            }
+            int total = 0;
+            for (auto const& symbol : prod.rhs) {
+                total = add_yields(total,
+                                   std::holds_alternative<LetterType>(symbol)
+                                       ? 1
+                                       : max_yield(std::get<Nonterminal>(symbol),
+                                                   productions,
+                                                   indexes,
+                                                   min_yields,
+                                                   lexical_yields,
+                                                   max_yields));
+            }
+            result = std::max(result, total);
+        }
+    }
+
+    max_yields[category] = result;
+    return result;
+}
+
+auto calculate_yield_bounds(std::vector<LetterProd> const& productions,
+                            Indexes const& indexes,
+                            std::map<Nonterminal, YieldBounds> const& lexical_yields)
+    -> std::map<Nonterminal, YieldBounds>
+{
+    // Shortest yields, by relaxing every production until nothing changes.
+    // Productions with an empty rhs are skipped since the parser never
+    // builds empty constituents.
+    std::map<Nonterminal, int> min_yields {};
+    for (auto const& [cat, bounds] : lexical_yields) {
+        min_yields[cat] = bounds.min;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto const& prod : productions) {
+            if (prod.rhs.empty()) {
+                continue;
+            }
+            int total = 0;
+            bool productive = true;
+            for (auto const& symbol : prod.rhs) {
+                if (std::holds_alternative<LetterType>(symbol)) {
+                    total = add_yields(total, 1);
+                } else if (auto iter = min_yields.find(std::get<Nonterminal>(symbol)); iter != min_yields.end()) {
+                    total = add_yields(total, iter->second);
+                } else {
+                    productive = false;
+                    break;
+                }
+            }
+            if (productive) {
+                auto [iter, inserted] = min_yields.try_emplace(prod.lhs, total);
+                if (inserted or total < iter->second) {
+                    iter->second = total;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Longest yields, by depth-first search; recursion makes them unbounded.
+    std::map<Nonterminal, std::optional<int>> max_yields {};
+    std::map<Nonterminal, YieldBounds> result {};
+    for (auto const& [cat, min] : min_yields) {
+        result[cat] = {min, max_yield(cat, productions, indexes, min_yields, lexical_yields, max_yields)};
+    }
+
+    return result;
+}
+
+auto calculate_rhs_yield_bounds(std::vector<LetterProd> const& productions,
+                                std::map<Nonterminal, YieldBounds> const& yield_bounds)
+    -> std::vector<RhsYieldBounds>
+{
+    std::vector<RhsYieldBounds> result {};
+    result.reserve(productions.size());
+
+    for (auto const& prod : productions) {
+        auto& bounds = result.emplace_back();
+        for (auto const& symbol : prod.rhs) {
+            if (std::holds_alternative<LetterType>(symbol)) {
+                bounds.symbols.push_back({1, 1});
+            } else if (auto iter = yield_bounds.find(std::get<Nonterminal>(symbol)); iter != yield_bounds.end()) {
+                bounds.symbols.push_back(iter->second);
+            } else {
+                bounds.symbols.emplace_back();
+            }
+        }
+
+        bounds.suffixes.resize(prod.rhs.size() + 1, {0, 0});
+        for (auto i = prod.rhs.size(); i > 0; --i) {
+            bounds.suffixes[i - 1] = add_yields(bounds.symbols[i - 1], bounds.suffixes[i]);
+        }
+    }
+
+    return result;
+}
+
 }  // namespace
 
-Pcfg::Pcfg(Nonterminal start, std::vector<LetterProd> productions)
+Pcfg::Pcfg(Nonterminal start,
+           std::vector<LetterProd> productions,
+           std::map<Nonterminal, YieldBounds> const& lexical_yields)
     : m_start {std::move(start)}
     , m_productions {std::move(productions)}
-    , m_categories {categories_set(m_productions)}
-    , m_indexes {calculate_indexes(m_productions)}
-    , m_leftcorner_relations {calculate_leftcorners(m_categories, m_productions)}
+    , m_indexes {std::make_shared<const Indexes>(calculate_indexes(m_productions))}
+    , m_categories {std::make_shared<const std::set<Nonterminal>>(categories_set(m_productions))}
+    , m_leftcorner_relations {
+          std::make_shared<const LeftcornerRelations>(calculate_leftcorners(*m_categories, m_productions))}
+    , m_yield_bounds {std::make_shared<const std::map<Nonterminal, YieldBounds>>(
+          calculate_yield_bounds(m_productions, *m_indexes, lexical_yields))}
+    , m_rhs_yield_bounds {std::make_shared<const std::vector<RhsYieldBounds>>(
+          calculate_rhs_yield_bounds(m_productions, *m_yield_bounds))}
+{
+}
+
+auto Pcfg::reweighted(std::span<const float> probabilities) const -> Pcfg
 {
+    if (probabilities.size() != m_productions.size()) {
+        throw std::invalid_argument {"Expected one probability per production"};
+    }
+
+    auto result = *this;  // copies the productions and shares the rest
+    for (std::size_t i = 0; i < probabilities.size(); ++i) {
+        result.m_productions[i].prob = probabilities[i];
+    }
+    return result;
 }
 
 auto Pcfg::start() const -> Nonterminal
@@ -154,4 +322,15 @@ auto Pcfg::productions() const -> std::vector<LetterProd> const&
     return m_productions;
 }
 
+auto Pcfg::yield_bounds(Nonterminal const& category) const -> YieldBounds
+{
+    auto iter = m_yield_bounds->find(category);
+    return iter == m_yield_bounds->end() ? YieldBounds {} : iter->second;
+}
+
+auto Pcfg::rhs_yield_bounds() const -> std::vector<RhsYieldBounds> const&
+{
+    return *m_rhs_yield_bounds;
+}
+
 }  // namespace parser
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
 #include <map>
+#include <memory>
 #include <set>
+#include <span>
 #include <vector>
 
 #include "nonterminal.hpp"
@@ -13,12 +19,13 @@ namespace parser
 using LetterType = char;
 using LetterProd = Production<LetterType>;
 
+// Productions by position in `Pcfg::productions()`.
 struct Indexes
 {
-    std::map<Nonterminal, std::vector<LetterProd>> lhs_index;
-    std::map<LetterProd::RhsType, std::vector<LetterProd>> rhs_index;
-    std::map<Nonterminal, LetterProd> empty_index;
-    std::map<LetterType, std::set<LetterProd>> lexical_index;
+    std::map<Nonterminal, std::vector<std::size_t>> lhs_index;
+    std::map<LetterProd::RhsType, std::vector<std::size_t>> rhs_index;
+    std::map<Nonterminal, std::size_t> empty_index;
+    std::map<LetterType, std::set<std::size_t>> lexical_index;
 };
 
 struct LeftcornerRelations
@@ -30,21 +37,72 @@ struct LeftcornerRelations
     std::map<Nonterminal, std::set<LetterType>> leftcorner_words;
 };
 
+/**
+ * @return whether a production of probability `prob` is always chosen,
+ * up to rounding, and so leaves the score of a tree unchanged.
+ */
+inline auto is_certain(float prob) -> bool
+{
+    return std::abs(prob - 1.0F) <= std::numeric_limits<float>::epsilon();
+}
+
+// Maximum yield of recursive categories.
+inline constexpr int unbounded_yield = std::numeric_limits<int>::max();
+
+// Range of the number of letters a category can span.  Categories that
+// cannot span anything have `min > max`.
+struct YieldBounds
+{
+    int min = unbounded_yield;
+    int max = 0;
+};
+
+inline auto overlap(YieldBounds lhs, YieldBounds rhs) -> bool
+{
+    return std::max(lhs.min, rhs.min) <= std::min(lhs.max, rhs.max);
+}
+
+struct RhsYieldBounds
+{
+    std::vector<YieldBounds> symbols;  // bounds of each rhs symbol
+    std::vector<YieldBounds> suffixes;  // bounds of rhs[i:], so suffixes.back() == {0, 0}
+};
+
 class Pcfg
 {
     Nonterminal m_start;
     std::vector<LetterProd> m_productions;
 
-    // Indexes
-    std::set<Nonterminal> m_categories;
-    Indexes m_indexes;
-    LeftcornerRelations m_leftcorner_relations;
+    // Indexes, relations and bounds that only depend on the shape of the
+    // productions, shared between a grammar and its reweighted copies.
+    std::shared_ptr<const Indexes> m_indexes;
+    std::shared_ptr<const std::set<Nonterminal>> m_categories;
+    std::shared_ptr<const LeftcornerRelations> m_leftcorner_relations;
+    std::shared_ptr<const std::map<Nonterminal, YieldBounds>> m_yield_bounds;
+    std::shared_ptr<const std::vector<RhsYieldBounds>> m_rhs_yield_bounds;  // parallel to m_productions
 
   public:
-    Pcfg(Nonterminal start, std::vector<LetterProd> productions);
+    /**
+     * `lexical_yields` gives the bounds of categories that are supplied
+     * to the parser directly instead of being derived from `productions`.
+     */
+    Pcfg(Nonterminal start,
+         std::vector<LetterProd> productions,
+         std::map<Nonterminal, YieldBounds> const& lexical_yields = {});
+
+    /**
+     * @return this grammar with the probability of `productions()[i]`
+     * replaced by `probabilities[i]`.  The indexes, relations and bounds
+     * that only depend on the shape of the productions are shared, not
+     * recomputed; only the productions are copied.
+     */
+    auto reweighted(std::span<const float> probabilities) const -> Pcfg;
 
     auto start() const -> Nonterminal;
     auto productions() const -> std::vector<LetterProd> const&;
+
+    auto yield_bounds(Nonterminal const& category) const -> YieldBounds;
+    auto rhs_yield_bounds() const -> std::vector<RhsYieldBounds> const&;
 };
 
 }  // namespace parser
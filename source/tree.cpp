@@ -16,33 +16,71 @@
 namespace parser
 {
 
+namespace
+{
+
+template<typename T, typename... Rest>
+void hash_combine(std::size_t& seed, const T& v, const Rest&... rest)
+{
+    seed ^= std::hash<T> {}(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    (hash_combine(seed, rest), ...);
+}
+
+}  // namespace
+
+Tree::Tree()
+    : Tree(Nonterminal {}, {}, 0.F)
+{
+}
+
 Tree::Tree(Nonterminal symbol_, std::vector<TreeNode> children_, float log_prob_)
-    : symbol {std::move(symbol_)}
-    , children {std::move(children_)}
-    , log_prob {log_prob_}
+    : log_prob {log_prob_}
+    , m_symbol {std::move(symbol_)}
+    , m_children {std::make_shared<const std::vector<TreeNode>>(std::move(children_))}
+{
+    // Children hash in constant time, from the hash they cached.
+    hash_combine(m_hash, m_symbol.name());
+    for (auto const& child : *m_children) {
+        hash_combine(m_hash, child);
+    }
+}
+
+auto Tree::symbol() const -> Nonterminal const&
 {
+    return m_symbol;
+}
+
+auto Tree::children() const -> std::vector<TreeNode> const&
+{
+    return *m_children;
+}
+
+auto Tree::hash() const -> std::size_t
+{
+    return m_hash;
 }
 
 auto Tree::operator<(Tree const& rhs) const -> bool
 {
-    if (symbol < rhs.symbol) {
+    if (m_symbol < rhs.m_symbol) {
         return true;
     }
-    if (rhs.symbol < symbol) {
+    if (rhs.m_symbol < m_symbol) {
         return false;
     }
-    return std::lexicographical_compare(children.begin(), children.end(), rhs.children.begin(), rhs.children.end());
+    return std::lexicographical_compare(
+        m_children->begin(), m_children->end(), rhs.m_children->begin(), rhs.m_children->end());
 }
 
 auto Tree::operator==(Tree const& rhs) const -> bool
 {
-    if (symbol.name() != rhs.symbol.name()) {
+    if (m_hash != rhs.m_hash or m_symbol != rhs.m_symbol) {
         return false;
     }
-    if (children.size() != rhs.children.size()) {
-        return false;
+    if (m_children == rhs.m_children) {
+        return true;
     }
-    return std::equal(children.begin(), children.end(), rhs.children.begin(), rhs.children.end());
+    return std::equal(m_children->begin(), m_children->end(), rhs.m_children->begin(), rhs.m_children->end());
 }
 
 auto Tree::str(int indent_level) const -> std::string
@@ -51,10 +89,10 @@ auto Tree::str(int indent_level) const -> std::string
     for (int i = 0; i < indent_level; ++i) {
         out << "  ";
     }
-    out << symbol.name() << "(\n";
+    out << m_symbol.name() << "(\n";
 
     bool first = true;
-    for (auto&& child : children) {
+    for (auto&& child : *m_children) {
         if (!first) {
             out << ",\n";
         }
@@ -93,9 +131,9 @@ overloaded(Ts...) -> overloaded<Ts...>;
 auto Tree::json() const -> nlohmann::json
 {
     auto children_json = std::vector<nlohmann::json> {};
-    children_json.reserve(children.size());
+    children_json.reserve(m_children->size());
 
-    for (auto&& child : children) {
+    for (auto&& child : *m_children) {
         std::visit(
             overloaded {
                 [&](Tree const& tree) { children_json.push_back(tree.json()); },
@@ -105,7 +143,7 @@ auto Tree::json() const -> nlohmann::json
     }
 
     return nlohmann::json {
-        {"label", symbol.name()},
+        {"label", m_symbol.name()},
         {"children", children_json},
         {"log_prob", log_prob},
     };
@@ -113,20 +151,7 @@ auto Tree::json() const -> nlohmann::json
 
 }  // namespace parser
 
-template<typename T, typename... Rest>
-void hash_combine(std::size_t& seed, const T& v, const Rest&... rest)
-{
-    seed ^= std::hash<T> {}(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-    (hash_combine(seed, rest), ...);
-}
-
 auto std::hash<parser::Tree>::operator()(const parser::Tree& tree) const -> std::size_t
 {
-    std::size_t value = 0;
-    hash_combine(value, tree.symbol.name());
-    for (auto&& child : tree.children) {
-        hash_combine(value, child);
-    }
-
-    return value;
+    return tree.hash();
 }
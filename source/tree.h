@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <memory>
 #include <string>
 #include <variant>
 #include <vector>
@@ -30,13 +31,17 @@ namespace parser
 struct Tree;
 using TreeNode = std::variant<Tree, LetterType>;
 
+/**
+ * A parse tree.  Its hash is computed once, at construction, from the
+ * hashes of its children, so its symbol and children are read-only;
+ * `log_prob` may change.  Copies share their children, so copying a tree
+ * takes constant time.
+ */
 struct Tree
 {
-    Nonterminal symbol;
-    std::vector<TreeNode> children;
     float log_prob = 0.F;
 
-    Tree() = default;
+    Tree();
     Tree(Nonterminal symbol, std::vector<TreeNode> children, float log_prob);
 
     Tree(Tree const&) = default;
@@ -47,11 +52,31 @@ struct Tree
 
     ~Tree() = default;
 
+    auto symbol() const -> Nonterminal const&;
+    auto children() const -> std::vector<TreeNode> const&;
+
     auto operator<(Tree const& rhs) const -> bool;
+
+    /**
+     * Trees with different hashes or symbols compare in constant time, as
+     * do trees that share their children.  Otherwise the children are
+     * compared in turn, each stopping where subtrees are shared, so equal
+     * trees built separately still take time in their size.
+     */
     auto operator==(Tree const& rhs) const -> bool;
 
+    /**
+     * @return the hash of the structure of this tree, ignoring `log_prob`.
+     */
+    auto hash() const -> std::size_t;
+
     auto str(int indent_level = 0) const -> std::string;
     auto json() const -> nlohmann::json;
+
+  private:
+    Nonterminal m_symbol;
+    std::shared_ptr<const std::vector<TreeNode>> m_children;
+    std::size_t m_hash = 0;
 };
 
 }  // namespace parser
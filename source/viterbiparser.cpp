@@ -1,8 +1,9 @@
 #include <algorithm>
 #include <cmath>
-#include <iterator>
-#include <limits>
+#include <cstddef>
+#include <cstdint>
 #include <map>
+#include <optional>
 #include <span>
 #include <tuple>
 #include <unordered_set>
@@ -12,7 +13,14 @@
 
 #include "viterbiparser.h"
 
+#include "chart.hpp"
+#include "coarse_to_fine.hpp"
+#include "grammar_optimizer.hpp"
+#include "lattice.hpp"
 #include "nonterminal.hpp"
+#include "parse_forest.hpp"
+#include "parse_limits.hpp"
+#include "parse_workspace.hpp"
 #include "pcfg.hpp"
 #include "tree.h"
 
@@ -20,190 +28,652 @@ namespace parser
 {
 
 ViterbiParser::ViterbiParser(Pcfg const& grammar)
-    : m_grammar(grammar)
+    : m_grammar(grammar, OptimizerOptions::none())
+    , m_chart_grammar(m_grammar.grammar())
 {
 }
 
 ViterbiParser::ViterbiParser(Pcfg&& grammar)
+    : m_grammar(std::move(grammar), OptimizerOptions::none())
+    , m_chart_grammar(m_grammar.grammar())
+{
+}
+
+ViterbiParser::ViterbiParser(Pcfg const& grammar,
+                             OptimizerOptions const& options,
+                             std::optional<CoarseToFineOptions> const& coarse_to_fine)
+    : m_grammar(grammar, options)
+    , m_chart_grammar(m_grammar.grammar())
+{
+    if (coarse_to_fine) {
+        m_coarse.emplace(m_grammar, *coarse_to_fine);
+    }
+}
+
+ViterbiParser::ViterbiParser(Pcfg&& grammar,
+                             OptimizerOptions const& options,
+                             std::optional<CoarseToFineOptions> const& coarse_to_fine)
+    : m_grammar(std::move(grammar), options)
+    , m_chart_grammar(m_grammar.grammar())
+{
+    if (coarse_to_fine) {
+        m_coarse.emplace(m_grammar, *coarse_to_fine);
+    }
+}
+
+ViterbiParser::ViterbiParser(OptimizedGrammar grammar, ChartGrammar chart_grammar, std::optional<CoarseGrammar> coarse)
     : m_grammar(std::move(grammar))
+    , m_chart_grammar(std::move(chart_grammar))
+    , m_coarse(std::move(coarse))
 {
 }
 
+auto ViterbiParser::reweighted(std::span<const float> probabilities) const -> ViterbiParser
+{
+    auto grammar = m_grammar.reweighted(probabilities);
+    auto chart_grammar = m_chart_grammar.reweighted(grammar.grammar());
+    auto coarse = std::optional<CoarseGrammar> {};
+    if (m_coarse) {
+        coarse = m_coarse->reweighted(grammar);
+    }
+    return {std::move(grammar), std::move(chart_grammar), std::move(coarse)};
+}
+
 namespace
 {
 
-struct Range
+/**
+ * The constituents allowed by the coarse pass; allows everything when
+ * coarse-to-fine parsing is disabled.
+ */
+struct CoarsePruning
 {
-    int begin, end;
+    CoarseGrammar const* grammar = nullptr;
+    CoarseChart const* chart = nullptr;
+
+    auto allows(int begin, int end, std::size_t production) const -> bool
+    {
+        return chart == nullptr or chart->allows(begin, end, grammar->production_category(production));
+    }
+
+    auto allows(int begin, int end, Nonterminal const& category) const -> bool
+    {
+        return chart == nullptr or chart->allows(begin, end, grammar->category(category));
+    }
 };
-using ConstituentKey = std::tuple<int, int, std::variant<Nonterminal, LetterType>>;  // (begin, end, symbol)
-using ConstituentMap = std::map<ConstituentKey, std::unordered_set<TreeNode>>;
 
 /**
- * @return a set of all the lists of children that cover `range`
- *  and that match `rhs`.
+ * Adds to the open span of a chart every constituent that covers it,
+ * built from the constituents of the shorter spans.
  */
-auto match_rhs(std::span<const std::variant<Nonterminal, LetterType>> rhs,
-               Range range,
-               ConstituentMap const& constituents) -> std::vector<std::vector<TreeNode>>
+class SpanFiller
 {
-    // Base case
-    if (range.begin >= range.end and rhs.empty()) {
-        return {std::vector<TreeNode> {}};
+    ChartGrammar const& m_grammar;
+    std::vector<RhsYieldBounds> const& m_bounds;
+    Lattice const& m_lattice;
+    CoarsePruning const& m_pruning;
+    Chart& m_chart;
+    std::vector<std::uint32_t>& m_children;  // children of the candidate being built
+    int m_begin = 0;
+
+  public:
+    SpanFiller(ChartGrammar const& grammar,
+               std::vector<RhsYieldBounds> const& bounds,
+               Lattice const& lattice,
+               CoarsePruning const& pruning,
+               Chart& chart,
+               std::vector<std::uint32_t>& children)
+        : m_grammar {grammar}
+        , m_bounds {bounds}
+        , m_lattice {lattice}
+        , m_pruning {pruning}
+        , m_chart {chart}
+        , m_children {children}
+    {
     }
-    if (range.begin >= range.end or rhs.empty()) {
-        return {};
+
+    void fill(int begin, int end)
+    {
+        m_begin = begin;
+        const auto distance = m_lattice.distance(begin, end);
+
+        for (std::size_t i = 0; i < m_grammar.productions().size(); ++i) {
+            try_production(i, end, distance);
+        }
+
+        // Since some of the grammar productions may be unary, we need to
+        // repeatedly try them until none of them add any new constituents.
+        // The others only depend on shorter spans.
+        while (m_chart.commit()) {
+            for (auto i : m_grammar.unary_productions()) {
+                try_production(i, end, distance);
+            }
+        }
+    }
+
+  private:
+    void try_production(std::size_t production, int end, YieldBounds distance)
+    {
+        // Skip productions that cannot span `distance` letters, or whose
+        // constituent was ruled out by the coarse pass.
+        if (not overlap(distance, m_bounds[production].suffixes[0])
+            or not m_pruning.allows(m_begin, end, production))
+        {
+            return;
+        }
+        m_children.clear();
+        match(production, 0, m_begin, end, m_grammar.productions()[production].log_prob);
     }
 
-    auto childlists = std::vector<std::vector<TreeNode>> {};
-    for (int split = range.begin; split <= range.end; ++split) {
-        if (constituents.contains({range.begin, split, rhs[0]})) {
-            auto const& lefts = constituents.at({range.begin, split, rhs[0]});
-            auto rights = match_rhs(rhs.subspan(1), {split, range.end}, constituents);
-            for (auto&& left : lefts) {
-                for (auto&& right : rights) {
-                    auto new_child = std::vector {left};
-                    new_child.reserve(1 + right.size());
-                    std::copy(right.begin(), right.end(), std::back_inserter(new_child));
-                    childlists.push_back(new_child);
+    /**
+     * Propose a constituent for every way of covering (position, end)
+     * with the symbols of `production` from `index` on, where `log_prob`
+     * is the score of the symbols before it.
+     */
+    void match(std::size_t production, std::size_t index, int position, int end, float log_prob)
+    {
+        auto const& prod = m_grammar.productions()[production];
+        if (index == prod.rhs.size()) {
+            if (position == end) {
+                m_chart.propose(prod.lhs, {log_prob, static_cast<std::int32_t>(prod.shape)}, m_children);
+            }
+            return;
+        }
+
+        auto const& bounds = m_bounds[production];
+        for (int split = index + 1 == prod.rhs.size() ? end : position + 1; split <= end; ++split) {
+            // Only try the splits that leave both this symbol and the
+            // rest of the rhs a span they can cover.
+            if (not overlap(m_lattice.distance(position, split), bounds.symbols[index])
+                or not overlap(m_lattice.distance(split, end), bounds.suffixes[index + 1]))
+            {
+                continue;
+            }
+
+            auto const& symbol = prod.rhs[index];
+            if (std::holds_alternative<LetterType>(symbol)) {
+                auto letter_log_prob = m_lattice.letter(position, split, std::get<LetterType>(symbol));
+                if (not letter_log_prob) {
+                    continue;
                 }
+                m_children.push_back(Chart::letter_child);
+                match(production, index + 1, split, end, log_prob + *letter_log_prob);
+                m_children.pop_back();
+                continue;
+            }
+
+            for (auto id : m_chart.cell(position, split, std::get<int>(symbol))) {
+                m_children.push_back(id);
+                match(production, index + 1, split, end, log_prob + m_chart.entry(id).log_prob);
+                m_children.pop_back();
             }
         }
     }
-
-    return childlists;
-}
+};
 
 /**
- * @return a list of the production instantiations that cover a
- * given span of the text.  A "production instantiation" is
- * a tuple containing a production and a list of children,
- * where the production's right hand side matches the list of
- * children; and the children cover `range`.
+ * @return the tree of the chart entry `id`.
  */
-auto find_instantiations(Range range,
-                         ConstituentMap const& constituents,
-                         Pcfg const& grammar) -> std::vector<std::pair<LetterProd, std::vector<TreeNode>>>
+auto build_tree(ChartGrammar const& grammar, Chart const& chart, std::uint32_t id) -> Tree
 {
-    auto result = std::vector<std::pair<LetterProd, std::vector<TreeNode>>> {};
-
-    for (auto&& production : grammar.productions()) {
-        auto childlists = match_rhs(std::span {production.rhs.begin(), production.rhs.end()}, range, constituents);
+    auto const& entry = chart.entry(id);
+    if (entry.lexical != nullptr) {
+        auto tree = *entry.lexical;
+        tree.log_prob = entry.log_prob;
+        return tree;
+    }
 
-        for (auto&& childlist : childlists) {
-            result.emplace_back(production, childlist);
+    auto const& prod = grammar.productions()[static_cast<std::size_t>(entry.production)];
+    auto const child_ids = chart.children(entry, prod.rhs.size());
+    auto children = std::vector<TreeNode> {};
+    children.reserve(prod.rhs.size());
+    for (std::size_t i = 0; i < prod.rhs.size(); ++i) {
+        if (std::holds_alternative<LetterType>(prod.rhs[i])) {
+            children.emplace_back(std::get<LetterType>(prod.rhs[i]));
+        } else {
+            children.emplace_back(build_tree(grammar, chart, child_ids[i]));
         }
     }
+    return Tree {grammar.category(prod.lhs), std::move(children), entry.log_prob};
+}
 
+/**
+ * @return the number of letters spelled by `tree`.
+ */
+auto count_letters(Tree const& tree) -> std::size_t
+{
+    std::size_t result = 0;
+    for (auto const& child : tree.children()) {
+        result += std::holds_alternative<Tree>(child) ? count_letters(std::get<Tree>(child)) : 1;
+    }
     return result;
 }
 
 /**
- * Find any constituents that might cover `range`, and add them
- * to the most likely constituents table.
+ * Unpacks a chart into a packed forest, following only the constituents
+ * that can be reached from a complete parse.  Nodes are numbered in the
+ * order they are first reached, so the root comes first.  `limits` are
+ * checked before each node is expanded.
  */
-auto add_constituents_spanning(Range range, ConstituentMap& constituents, int top_k, Pcfg const& grammar)
-{
-    // Since some of the grammar productions may be unary, we need to
-    // repeatedly try all of the productions until none of them add any
-    // new constituents.
-    bool changed = true;
-    while (changed) {
-        changed = false;
-
-        // Find all ways instantiations of the grammar productions that
-        // cover the span.
-        auto instantiations = find_instantiations(range, constituents, grammar);
-
-        // For each production instantiation, add a new
-        // Tree whose probability is the product of the
-        // children's probabilities and the production's
-        // probability.
-        for (auto&& [production, children] : instantiations) {
-            float log_p = std::log(production.prob);
-            for (auto&& child : children) {
-                if (std::holds_alternative<Tree>(child)) {
-                    log_p += std::get<Tree>(child).log_prob;
+class ForestBuilder
+{
+    using NodeKey = std::tuple<int, int, Nonterminal>;  // (begin, end, symbol)
+
+    OptimizedGrammar const& m_grammar;
+    ChartGrammar const& m_chart_grammar;
+    Lattice const& m_lattice;
+    Chart const& m_chart;
+    ParseLimits const& m_limits;
+    std::map<NodeKey, std::size_t> m_node_ids;
+    ParseForest m_forest;
+    std::size_t m_num_derivations = 0;
+    ParseStatus m_status = ParseStatus::Complete;
+
+  public:
+    ForestBuilder(OptimizedGrammar const& grammar,
+                  ChartGrammar const& chart_grammar,
+                  Lattice const& lattice,
+                  Chart const& chart,
+                  ParseLimits const& limits)
+        : m_grammar {grammar}
+        , m_chart_grammar {chart_grammar}
+        , m_lattice {lattice}
+        , m_chart {chart}
+        , m_limits {limits}
+    {
+    }
+
+    /**
+     * @return the forest, or an empty one if a limit stopped it.
+     */
+    auto build() -> ParseForest
+    {
+        const int start = m_chart_grammar.start();
+        const int final_node = m_lattice.final_node();
+        if (not m_chart.cell(0, final_node, start).empty()) {
+            node(start, 0, final_node);
+        }
+        if (m_status != ParseStatus::Complete) {
+            return {};
+        }
+        return std::move(m_forest);
+    }
+
+    /**
+     * @return whether the last build ran to the end, or which limit
+     * stopped it.
+     */
+    auto status() const -> ParseStatus { return m_status; }
+
+  private:
+    /**
+     * @return the index of the node for `key`, and whether it is new.
+     */
+    auto add_node(NodeKey const& key, float log_prob) -> std::pair<std::size_t, bool>
+    {
+        auto [iter, inserted] = m_node_ids.try_emplace(key, m_forest.nodes.size());
+        if (inserted) {
+            auto const& [begin, end, symbol] = key;
+            m_forest.nodes.push_back({symbol, begin, end, log_prob, {}});
+        }
+        return {iter->second, inserted};
+    }
+
+    /**
+     * @return the index of the node of the chart constituent `category`
+     * over (begin, end), adding it and its derivations if needed.
+     */
+    auto node(int category, int begin, int end) -> std::size_t
+    {
+        auto const& symbol = m_chart_grammar.category(category);
+        if (auto iter = m_node_ids.find({begin, end, symbol}); iter != m_node_ids.end()) {
+            return iter->second;
+        }
+
+        auto const cell = m_chart.cell(begin, end, category);
+        auto const& best = m_chart.entry(*std::max_element(cell.begin(),
+                                                           cell.end(),
+                                                           [&](auto lhs, auto rhs) {
+                                                               return m_chart.entry(lhs).log_prob
+                                                                   < m_chart.entry(rhs).log_prob;
+                                                           }));
+
+        if (best.lexical != nullptr) {
+            // A lexical category, which the lexicon proposed whole.
+            auto letters = std::vector<LetterType> {};
+            collect_letters(*best.lexical, letters);
+            return lexical_node(*best.lexical, best_path(letters, begin, end)->second);
+        }
+
+        // Once a limit is hit, nodes are added without their derivations
+        // so that the recursion unwinds.
+        if (m_status == ParseStatus::Complete) {
+            m_status = check_limits(m_limits, m_num_derivations);
+        }
+        const auto id = add_node({begin, end, symbol}, best.log_prob).first;
+        if (m_status != ParseStatus::Complete) {
+            return id;
+        }
+        for (auto production : m_chart_grammar.productions_of(category)) {
+            auto splits = std::vector<int> {begin};
+            add_derivations(id, production, splits, end);
+        }
+        return id;
+    }
+
+    /**
+     * Add to node `id` a derivation for every way of splitting the rest
+     * of its span among the symbols of `production` that follow `splits`.
+     */
+    void add_derivations(std::size_t id, std::size_t production, std::vector<int>& splits, int end)
+    {
+        if (m_status != ParseStatus::Complete) {
+            return;
+        }
+        auto const& prod = m_chart_grammar.productions()[production];
+        auto const& bounds = m_grammar.grammar().rhs_yield_bounds()[production];
+        const std::size_t index = splits.size() - 1;
+        const int begin = splits.back();
+
+        if (index == prod.rhs.size()) {
+            if (begin == end) {
+                add_derivation(id, production, splits);
+            }
+            return;
+        }
+
+        for (int split = index + 1 == prod.rhs.size() ? end : begin + 1; split <= end; ++split) {
+            if (not overlap(m_lattice.distance(begin, split), bounds.symbols[index])
+                or not overlap(m_lattice.distance(split, end), bounds.suffixes[index + 1]))
+            {
+                continue;
+            }
+            auto const& symbol = prod.rhs[index];
+            const bool present = std::holds_alternative<LetterType>(symbol)
+                ? m_lattice.letter(begin, split, std::get<LetterType>(symbol)).has_value()
+                : not m_chart.cell(begin, split, std::get<int>(symbol)).empty();
+            if (not present) {
+                continue;
+            }
+            splits.push_back(split);
+            add_derivations(id, production, splits, end);
+            splits.pop_back();
+        }
+    }
+
+    void add_derivation(std::size_t id, std::size_t production, std::vector<int> const& splits)
+    {
+        auto const& prod = m_chart_grammar.productions()[production];
+        auto const& original = m_grammar.grammar().productions()[production];
+        auto const elided = m_grammar.elided_categories(original.lhs, original.rhs);
+
+        auto derivation = ForestDerivation {prod.log_prob, {}};
+        for (std::size_t i = 0; i < prod.rhs.size(); ++i) {
+            if (std::holds_alternative<LetterType>(prod.rhs[i])) {
+                const auto letter = std::get<LetterType>(prod.rhs[i]);
+                derivation.log_prob += *m_lattice.letter(splits[i], splits[i + 1], letter);
+                derivation.children.emplace_back(letter);
+                continue;
+            }
+            auto child = node(std::get<int>(prod.rhs[i]), splits[i], splits[i + 1]);
+            if (not elided.empty()) {
+                // Put back the categories of collapsed unary chains.
+                for (auto iter = elided[i].rbegin(); iter != elided[i].rend(); ++iter) {
+                    child = wrap(*iter, child);
                 }
             }
+            derivation.log_prob += m_forest.nodes[child].log_prob;
+            derivation.children.emplace_back(child);
+        }
+        m_forest.nodes[id].derivations.push_back(std::move(derivation));
+        ++m_num_derivations;
+    }
+
+    /**
+     * @return the node of `symbol` deriving node `child` with probability 1.
+     */
+    auto wrap(Nonterminal const& symbol, std::size_t child) -> std::size_t
+    {
+        auto const begin = m_forest.nodes[child].begin;
+        auto const end = m_forest.nodes[child].end;
+        const float log_prob = m_forest.nodes[child].log_prob;
+        auto [id, inserted] = add_node({begin, end, symbol}, log_prob);
+        if (inserted) {
+            m_forest.nodes[id].derivations.push_back({log_prob, {child}});
+            ++m_num_derivations;
+        }
+        return id;
+    }
+
+    /**
+     * @return the node of the lexical tree `tree` spelled along the
+     * lattice nodes in `path`.
+     */
+    auto lexical_node(Tree const& tree, std::span<const int> path) -> std::size_t
+    {
+        auto [id, inserted] = add_node({path.front(), path.back(), tree.symbol()}, tree.log_prob);
+        if (not inserted) {
+            return id;
+        }
+
+        auto derivation = ForestDerivation {};
+        float path_log_prob = 0.F;
+        std::size_t position = 0;
+        for (auto const& child : tree.children()) {
+            if (std::holds_alternative<LetterType>(child)) {
+                const auto letter = std::get<LetterType>(child);
+                path_log_prob += *m_lattice.letter(path[position], path[position + 1], letter);
+                derivation.children.emplace_back(letter);
+                ++position;
+                continue;
+            }
+            auto const& subtree = std::get<Tree>(child);
+            const auto length = count_letters(subtree);
+            const auto child_id = lexical_node(subtree, path.subspan(position, length + 1));
+            path_log_prob += m_forest.nodes[child_id].log_prob - subtree.log_prob;
+            derivation.children.emplace_back(child_id);
+            position += length;
+        }
 
-            auto node = production.lhs;
-            auto tree = Tree {node, children, log_p};
+        derivation.log_prob = tree.log_prob + path_log_prob;
+        m_forest.nodes[id].log_prob = derivation.log_prob;
+        m_forest.nodes[id].derivations.push_back(std::move(derivation));
+        ++m_num_derivations;
+        return id;
+    }
 
-            // If it's a new constituent, then add it to the
-            // constituents dictionary.
-            auto key = std::tuple {range.begin, range.end, production.lhs};
-            if (not constituents.contains(key)) {
-                constituents[key] = {tree};
-                changed = true;
+    static void collect_letters(Tree const& tree, std::vector<LetterType>& letters)
+    {
+        for (auto const& child : tree.children()) {
+            if (std::holds_alternative<Tree>(child)) {
+                collect_letters(std::get<Tree>(child), letters);
             } else {
-                auto& constituent = constituents.at(key);
-                const bool contains = constituent.contains(tree);
-                if (not contains) {
-                    const int c_size = static_cast<int>(constituent.size());
-                    float min_log_prob = std::numeric_limits<float>::max();
-                    for (auto&& c_tree : constituent) {
-                        min_log_prob = std::min(min_log_prob, std::get<Tree>(c_tree).log_prob);
-                    }
-
-                    if (c_size < top_k or min_log_prob < tree.log_prob) {
-                        constituent.insert(tree);
-                        if (c_size > top_k) {
-                            constituent.erase(std::min_element(
-                                constituent.begin(),
-                                constituent.end(),
-                                [](auto&& lhs, auto&& rhs)
-                                { return std::get<Tree>(lhs).log_prob < std::get<Tree>(rhs).log_prob; }));
-                        }
-                        changed = true;
-                    }
-                }
+                letters.push_back(std::get<LetterType>(child));
             }
         }
     }
-}
+
+    /**
+     * @return the score and the nodes of the best path of the lattice
+     * from `begin` to `end` that spells `letters`.
+     */
+    auto best_path(std::span<const LetterType> letters, int begin, int end) const
+        -> std::optional<std::pair<float, std::vector<int>>>
+    {
+        if (letters.empty()) {
+            return begin == end ? std::optional {std::pair {0.F, std::vector {end}}} : std::nullopt;
+        }
+
+        auto result = std::optional<std::pair<float, std::vector<int>>> {};
+        for (auto const& edge : m_lattice.edges_from(begin)) {
+            if (edge.letter != letters[0]) {
+                continue;
+            }
+            auto rest = best_path(letters.subspan(1), edge.to, end);
+            if (rest and (not result or rest->first + edge.log_prob > result->first)) {
+                rest->second.insert(rest->second.begin(), begin);
+                result = {rest->first + edge.log_prob, std::move(rest->second)};
+            }
+        }
+        return result;
+    }
+};
 
 }  // namespace
 
-auto ViterbiParser::parse(std::vector<LetterType> const& tokens, int top_k) const -> std::unordered_set<Tree>
+void ViterbiParser::fill_chart(Lattice const& lattice,
+                               ParseWorkspace& workspace,
+                               int top_k,
+                               ParseLimits const& limits) const
 {
-    // The most likely constituent table.  This table specifies the
-    // most likely constituent for a given span and type.
-    // Constituents can be either Trees or tokens.  For Trees,
-    // the "type" is the Nonterminal for the tree's root node
-    // value.  For Tokens, the "type" is the token's type.
-    // The table is stored as a dictionary, since it is sparse.
-    ConstituentMap constituents {};
+    // The chart keeps a record per span, which counts against the
+    // budget; check the limits before it grows to fit the lattice.
+    const auto num_spans = static_cast<std::size_t>(lattice.num_nodes()) * static_cast<std::size_t>(lattice.num_nodes());
+    workspace.m_status = check_limits(limits, num_spans);
+    if (workspace.m_status != ParseStatus::Complete) {
+        return;
+    }
 
-    // Initialize the constituents dictionary with the words from the text.
-    int index = 0;
-    for (auto token : tokens) {
-        constituents[{index, index + 1, token}] = {{token}};
-        index++;
+    // With coarse-to-fine parsing, first find out which constituents
+    // are worth building.
+    auto const& lexicon = m_grammar.lexicon();
+    auto coarse_chart = std::optional<CoarseChart> {};
+    auto pruning = CoarsePruning {};
+    if (m_coarse) {
+        coarse_chart = m_coarse->prune(lattice, lexicon, workspace.m_coarse, limits);
+        if (coarse_chart->status() != ParseStatus::Complete) {
+            workspace.m_status = coarse_chart->status();
+            return;
+        }
+        pruning = {&*m_coarse, &*coarse_chart};
     }
 
-    // Consider each span of length 1, 2, ..., n; and add any trees
-    // that might cover that span to the constituents dictionary.
-    const int num_tokens = static_cast<int>(tokens.size());
-    for (int length = 1; length <= num_tokens; ++length) {
-        // Find the most likely constituent spanning `length` text elements
-        for (int begin = 0; begin <= num_tokens - length; ++begin) {
-            add_constituents_spanning({begin, begin + length}, constituents, top_k, m_grammar);
+    auto& chart = workspace.m_chart;
+    chart.reset(lattice.num_nodes(), m_chart_grammar.num_categories(), top_k);
+
+    // Collect the lexical categories that the grammar optimizer took out
+    // of the grammar, straight from the letters they spell.  Sort them in
+    // the order their spans are filled in, best path first.
+    auto& seeds = workspace.m_seeds;
+    seeds.clear();
+    const int num_nodes = lattice.num_nodes();
+    if (not lexicon.empty()) {
+        for (int begin = 0; begin < num_nodes; ++begin) {
+            lexicon.match_paths(lattice,
+                                begin,
+                                [&](int end, Tree const& tree, float path_log_prob)
+                                {
+                                    const int category = m_chart_grammar.id(tree.symbol());
+                                    if (category < 0 or not pruning.allows(begin, end, tree.symbol())) {
+                                        return;
+                                    }
+                                    seeds.push_back({begin, end, category, &tree, tree.log_prob + path_log_prob});
+                                });
         }
+        std::sort(seeds.begin(),
+                  seeds.end(),
+                  [](auto const& lhs, auto const& rhs)
+                  {
+                      return std::tuple {lhs.end - lhs.begin, lhs.begin, lhs.category, rhs.log_prob}
+                      < std::tuple {rhs.end - rhs.begin, rhs.begin, rhs.category, lhs.log_prob};
+                  });
     }
 
-    // Return the tree that spans the entire text & have the right cat
-    if (constituents.contains({0, num_tokens, m_grammar.start()})) {
-        auto result_nodes = constituents[{0, num_tokens, m_grammar.start()}];
-        std::unordered_set<Tree> result {};
-        for (auto&& node : result_nodes) {
-            result.insert(std::get<Tree>(node));
+    // Consider each span of length 1, 2, ..., n; and add any trees
+    // that might cover that span to the chart.  Nodes are ordered, so
+    // shorter spans come before the spans they are part of.
+    auto filler = SpanFiller {m_chart_grammar,
+                              m_grammar.grammar().rhs_yield_bounds(),
+                              lattice,
+                              pruning,
+                              chart,
+                              workspace.m_children};
+    auto seed = seeds.begin();
+    const int final_node = lattice.final_node();
+    for (int length = 1; length <= final_node; ++length) {
+        for (int begin = 0; begin <= final_node - length; ++begin) {
+            // Skip pairs of nodes with no path between them.
+            const int end = begin + length;
+            if (auto distance = lattice.distance(begin, end); distance.min > distance.max) {
+                continue;
+            }
+
+            if (auto status = check_limits(limits, num_spans + chart.num_entries()); status != ParseStatus::Complete)
+            {
+                workspace.m_status = status;
+                return;
+            }
+
+            chart.open(begin, end);
+            // Only the best path to each lexical tree is kept.
+            for (; seed != seeds.end() and seed->begin == begin and seed->end == end; ++seed) {
+                chart.offer(seed->category, {seed->log_prob, -1, 0, 0, seed->tree}, {});
+            }
+            filler.fill(begin, end);
+            chart.close();
         }
-        return result;
     }
+}
 
-    // No solution found
-    return {};
+auto ViterbiParser::parse(std::vector<LetterType> const& tokens, int top_k) const -> std::unordered_set<Tree>
+{
+    return parse(Lattice::from_letters(tokens), top_k);
+}
+
+auto ViterbiParser::parse(Lattice const& lattice, int top_k) const -> std::unordered_set<Tree>
+{
+    auto workspace = ParseWorkspace {};
+    std::unordered_set<Tree> result {};
+    for (auto const& ref : parse(lattice, workspace, top_k)) {
+        result.insert(tree(workspace, ref));
+    }
+    return result;
+}
+
+auto ViterbiParser::parse(Lattice const& lattice, ParseWorkspace& workspace, int top_k, ParseLimits const& limits) const
+    -> std::span<const ParseRef>
+{
+    fill_chart(lattice, workspace, top_k, limits);
+
+    // The trees that span the entire text & have the right cat
+    auto const& chart = workspace.m_chart;
+    auto& results = workspace.m_results;
+    results.clear();
+    if (workspace.m_status != ParseStatus::Complete) {
+        // A stopped parse may not have reset the chart.
+        return results;
+    }
+    for (auto id : chart.cell(0, lattice.final_node(), m_chart_grammar.start())) {
+        results.push_back({id, chart.entry(id).log_prob});
+    }
+    std::sort(results.begin(),
+              results.end(),
+              [](auto const& lhs, auto const& rhs) { return lhs.log_prob > rhs.log_prob; });
+    return results;
+}
+
+auto ViterbiParser::tree(ParseWorkspace const& workspace, ParseRef parse) const -> Tree
+{
+    return m_grammar.restore(build_tree(m_chart_grammar, workspace.m_chart, parse.entry));
+}
+
+auto ViterbiParser::parse_forest(Lattice const& lattice) const -> ParseForest
+{
+    auto workspace = ParseWorkspace {};
+    return parse_forest(lattice, workspace);
+}
+
+auto ViterbiParser::parse_forest(Lattice const& lattice, ParseWorkspace& workspace, ParseLimits const& limits) const
+    -> ParseForest
+{
+    fill_chart(lattice, workspace, 1, limits);
+    if (workspace.m_status != ParseStatus::Complete) {
+        return {};
+    }
+    auto builder = ForestBuilder {m_grammar, m_chart_grammar, lattice, workspace.m_chart, limits};
+    auto forest = builder.build();
+    workspace.m_status = builder.status();
+    return forest;
 }
 
 }  // namespace parser
@@ -1,8 +1,17 @@
 #pragma once
 
+#include <optional>
+#include <span>
 #include <unordered_set>
 #include <vector>
 
+#include "chart.hpp"
+#include "coarse_to_fine.hpp"
+#include "grammar_optimizer.hpp"
+#include "lattice.hpp"
+#include "parse_forest.hpp"
+#include "parse_limits.hpp"
+#include "parse_workspace.hpp"
 #include "pcfg.hpp"
 #include "tree.h"
 
@@ -11,13 +20,80 @@ namespace parser
 
 class ViterbiParser
 {
-    Pcfg m_grammar;
+    OptimizedGrammar m_grammar;
+    ChartGrammar m_chart_grammar;
+    std::optional<CoarseGrammar> m_coarse;
 
   public:
     explicit ViterbiParser(Pcfg const& grammar);
     explicit ViterbiParser(Pcfg&& grammar);
+    ViterbiParser(Pcfg const& grammar,
+                  OptimizerOptions const& options,
+                  std::optional<CoarseToFineOptions> const& coarse_to_fine = std::nullopt);
+    ViterbiParser(Pcfg&& grammar,
+                  OptimizerOptions const& options,
+                  std::optional<CoarseToFineOptions> const& coarse_to_fine = std::nullopt);
+
+    /**
+     * @return a parser for the grammar this one was built from, with the
+     * probability of its i-th production replaced by `probabilities[i]`.
+     * Reuses the structure of this parser instead of building it again.
+     *
+     * @throws std::invalid_argument if the grammar optimizer relied on a
+     * probability that changes; see `OptimizedGrammar::reweighted()`.
+     */
+    auto reweighted(std::span<const float> probabilities) const -> ViterbiParser;
 
     auto parse(std::vector<LetterType> const& tokens, int top_k = 1) const -> std::unordered_set<Tree>;
+
+    /**
+     * Parse all the paths of `lattice` at once, sharing the constituents
+     * of common sub-spans.
+     *
+     * @return the best trees over any path from its first to last node.
+     */
+    auto parse(Lattice const& lattice, int top_k = 1) const -> std::unordered_set<Tree>;
+
+    /**
+     * Parse `lattice` in the chart and buffers of `workspace`.  Once the
+     * workspace has grown to fit the input, this does not allocate.
+     *
+     * The parse stops early when it runs into one of `limits`, in which
+     * case `workspace.status()` says which.  It then has no complete
+     * parse to return, since the span of the whole lattice comes last.
+     *
+     * @return the parses that span the whole lattice, best first.  They
+     * stay valid until the workspace is used again; see `tree()`.
+     */
+    auto parse(Lattice const& lattice, ParseWorkspace& workspace, int top_k = 1, ParseLimits const& limits = {}) const
+        -> std::span<const ParseRef>;
+
+    /**
+     * @return the tree of a parse found in `workspace`.
+     */
+    auto tree(ParseWorkspace const& workspace, ParseRef parse) const -> Tree;
+
+    /**
+     * Parse `lattice` and keep every derivation of every constituent
+     * that can be part of a complete parse, packed by (symbol, begin, end).
+     *
+     * @return an empty forest if there is no parse.
+     */
+    auto parse_forest(Lattice const& lattice) const -> ParseForest;
+
+    /**
+     * Build the forest of `lattice` in `workspace`, within `limits`.
+     *
+     * @return an empty forest if there is no parse or a limit stopped the
+     * parse; see `workspace.status()`.
+     */
+    auto parse_forest(Lattice const& lattice, ParseWorkspace& workspace, ParseLimits const& limits = {}) const
+        -> ParseForest;
+
+  private:
+    ViterbiParser(OptimizedGrammar grammar, ChartGrammar chart_grammar, std::optional<CoarseGrammar> coarse);
+
+    void fill_chart(Lattice const& lattice, ParseWorkspace& workspace, int top_k, ParseLimits const& limits) const;
 };
 
 }  // namespace parser
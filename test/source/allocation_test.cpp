@@ -0,0 +1,101 @@
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "coarse_to_fine.hpp"
+#include "grammar_loader.hpp"
+#include "grammar_optimizer.hpp"
+#include "lattice.hpp"
+#include "nonterminal.hpp"
+#include "parse_workspace.hpp"
+#include "pcfg.hpp"
+#include "viterbiparser.h"
+
+// Replaces the global allocation functions of this executable only, to
+// count the allocations made while parsing.
+
+namespace
+{
+
+std::size_t num_allocations = 0;
+
+auto counted_allocation(std::size_t size) -> void*
+{
+    ++num_allocations;
+    if (void* result = std::malloc(size == 0 ? 1 : size)) {
+        return result;
+    }
+    throw std::bad_alloc {};
+}
+
+}  // namespace
+
+auto operator new(std::size_t size) -> void*
+{
+    return counted_allocation(size);
+}
+
+auto operator new[](std::size_t size) -> void*
+{
+    return counted_allocation(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t /*unused*/) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t /*unused*/) noexcept
+{
+    std::free(pointer);
+}
+
+TEST_CASE("Test", "[test_workspace_allocations]")
+{
+    using Symb = parser::Nonterminal;
+    auto prods_file = std::ifstream("examples/prods.json");
+    auto productions = parser::load_grammar(prods_file).productions;
+
+    const std::string long_word = "hakeysssupnitaGipnita";
+    const std::string short_word = "hasimyen";
+    const auto long_lattice = parser::Lattice::from_letters(std::vector<char>(long_word.begin(), long_word.end()));
+    const auto short_lattice = parser::Lattice::from_letters(std::vector<char>(short_word.begin(), short_word.end()));
+
+    for (bool coarse_to_fine : {false, true}) {
+        const auto parser = coarse_to_fine
+            ? parser::ViterbiParser(parser::Pcfg(Symb("Noun"), productions),
+                                    parser::OptimizerOptions {},
+                                    parser::CoarseToFineOptions {})
+            : parser::ViterbiParser(parser::Pcfg(Symb("Noun"), productions), parser::OptimizerOptions {});
+
+        auto workspace = parser::ParseWorkspace {};
+        const auto cold = num_allocations;
+        parser.parse(long_lattice, workspace, 3);
+        REQUIRE(num_allocations > cold);
+        parser.parse(short_lattice, workspace, 3);
+
+        const auto before = num_allocations;
+        const auto long_parses = parser.parse(long_lattice, workspace, 3).size();
+        const auto short_parses = parser.parse(short_lattice, workspace, 3).size();
+        const auto allocations = num_allocations - before;
+
+        REQUIRE(long_parses > 0);
+        REQUIRE(short_parses > 0);
+        REQUIRE(allocations == 0);
+    }
+}
@@ -1,15 +1,53 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <variant>
 #include <vector>
 
+#include <catch2/catch_approx.hpp>
 #include <catch2/catch_test_macros.hpp>
 #include <nlohmann/json.hpp>
 
+#include "coarse_to_fine.hpp"
+#include "grammar_loader.hpp"
+#include "grammar_optimizer.hpp"
+#include "grammar_registry.hpp"
+#include "lattice.hpp"
 #include "nonterminal.hpp"
+#include "parse_forest.hpp"
+#include "parse_limits.hpp"
+#include "parse_workspace.hpp"
 #include "pcfg.hpp"
 #include "viterbiparser.h"
 
+namespace
+{
+
+/**
+ * @return the printed trees, scores included, so that parses can be compared.
+ */
+auto as_strings(std::unordered_set<parser::Tree> const& trees) -> std::set<std::string>
+{
+    std::set<std::string> result;
+    for (auto const& tree : trees) {
+        result.insert(tree.str());
+    }
+    return result;
+}
+
+}  // namespace
+
 TEST_CASE("Test", "[test_basic]")
 {
     using Symb = parser::Nonterminal;
@@ -37,23 +75,8 @@ TEST_CASE("Test", "[test_complex]")
 {
     using Symb = parser::Nonterminal;
     auto t0 = std::chrono::high_resolution_clock::now();
-    std::vector<parser::LetterProd> productions {};
-
     auto prods_file = std::ifstream("examples/prods.json");
-    auto rules = nlohmann::json::parse(prods_file);
-    for (auto&& rule : rules) {
-        auto lhs = rule["lhs"].get<std::string>();
-        auto prob = rule["prob"].get<float>();
-        auto rhs = std::vector<std::variant<parser::Nonterminal, parser::LetterType>> {};
-        for (auto&& item : rule["rhs"]) {
-            if (item.is_object()) {
-                rhs.push_back(Symb(item["name"].get<std::string>()));
-            } else {
-                rhs.push_back(item.get<std::string>()[0]);
-            }
-        }
-        productions.push_back({Symb(lhs), rhs, prob});
-    }
+    auto productions = parser::load_grammar(prods_file).productions;
 
     const auto parser = parser::ViterbiParser(parser::Pcfg(Symb("Noun"), productions));
 
@@ -72,3 +95,527 @@ TEST_CASE("Test", "[test_complex]")
     std::cout << "Took " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << "ms\n";
     std::cout.flush();
 }
+
+TEST_CASE("Test", "[test_grammar_loader]")
+{
+    using Symb = parser::Nonterminal;
+
+    auto bare = std::istringstream(R"([
+        {"lhs": "S", "rhs": [{"type": "Nonterminal", "name": "A"}, "b"], "prob": 0.5},
+        {"lhs": "A", "rhs": ["a"], "prob": 1}
+    ])");
+    auto bare_document = parser::load_grammar(bare);
+
+    REQUIRE(bare_document.productions.size() == 2);
+    REQUIRE(bare_document.productions[0].lhs.name() == "S");
+    REQUIRE(std::get<Symb>(bare_document.productions[0].rhs[0]).name() == "A");
+    REQUIRE(std::get<parser::LetterType>(bare_document.productions[0].rhs[1]) == 'b');
+    REQUIRE(bare_document.productions[0].prob == Catch::Approx(0.5));
+    REQUIRE(bare_document.productions[1].prob == Catch::Approx(1.0));
+    REQUIRE(bare_document.attributes.empty());
+
+    auto request = std::istringstream(R"({
+        "start_symbol": "S",
+        "rules": [{"lhs": "S", "rhs": ["a"], "prob": 1.0}],
+        "sentence": "a",
+        "num_trees": 3,
+        "options": {"rules": [1, 2]}
+    })");
+    auto request_document = parser::load_grammar(request);
+
+    REQUIRE(request_document.productions.size() == 1);
+    REQUIRE(request_document.attributes.at("start_symbol") == "S");
+    REQUIRE(request_document.attributes.at("sentence") == "a");
+    REQUIRE(request_document.attributes.at("num_trees") == 3);
+    REQUIRE(request_document.attributes.at("options").at("rules").size() == 2);
+
+    for (auto const* malformed : {
+             R"([{"lhs": "S", "rhs": ["a"], "prob": "x"}])",
+             R"([{"lhs": "S", "rhs": ["a"], "prob": null}])",
+             R"([{"lhs": "S", "rhs": ["a"]}])",
+             R"([{"lhs": "S", "prob": 1.0}])",
+             R"([{"lhs": "S", "rhs": "a", "prob": 1.0}])",
+             R"([{"lhs": "S", "rhs": {"a": 1}, "prob": 1.0}])",
+             R"([{"lhs": 1, "rhs": ["a"], "prob": 1.0}])",
+             R"([{"lhs": ["S"], "rhs": ["a"], "prob": 1.0}])",
+         })
+    {
+        auto stream = std::istringstream(malformed);
+        REQUIRE_THROWS_AS(parser::load_grammar(stream), std::invalid_argument);
+    }
+}
+
+TEST_CASE("Test", "[test_grammar_optimizer]")
+{
+    using Symb = parser::Nonterminal;
+    const auto grammar = parser::Pcfg(  //
+        Symb("S"),
+        {
+            {Symb("S"), {Symb("Pre"), Symb("R")}, 0.9F},
+            {Symb("S"), {Symb("S"), Symb("Dead")}, 0.1F},
+            {Symb("Pre"), {Symb("Lex_ab")}, 1.0},
+            {Symb("Lex_ab"), {Symb("Lex_a"), Symb("Lex_b")}, 1.0},
+            {Symb("Lex_a"), {'a'}, 1.0},
+            {Symb("Lex_b"), {'b'}, 1.0},
+            {Symb("R"), {Symb("R"), Symb("B")}, 0.5},
+            {Symb("R"), {Symb("B")}, 0.5},
+            {Symb("B"), {Symb("C")}, 1.0},
+            {Symb("C"), {'c'}, 0.7F},
+            {Symb("C"), {'d'}, 0.3F},
+            {Symb("Unused"), {'u'}, 1.0},
+        });
+
+    const auto optimizer = parser::OptimizedGrammar(grammar);
+    auto const& productions = optimizer.grammar().productions();
+    auto mentions = [&](Symb const& category)
+    {
+        return std::any_of(productions.begin(),
+                           productions.end(),
+                           [&](parser::LetterProd const& prod)
+                           {
+                               return prod.lhs == category
+                                   or std::find(prod.rhs.begin(), prod.rhs.end(), parser::LetterProd::RhsType {category})
+                                   != prod.rhs.end();
+                           });
+    };
+    REQUIRE(!mentions(Symb("Unused")));
+    REQUIRE(!mentions(Symb("Dead")));
+    REQUIRE(!mentions(Symb("B")));
+
+    // Lex_ab spells out "ab" and is proposed by the lexicon, under Pre,
+    // its only parent.
+    REQUIRE(!optimizer.lexicon().empty());
+    const std::vector<parser::LetterType> ab {'a', 'b'};
+    auto proposed = std::vector<parser::Tree> {};
+    optimizer.lexicon().match_paths(parser::Lattice::from_letters(ab),
+                                    0,
+                                    [&](int end, parser::Tree const& tree, float /*log_prob*/)
+                                    {
+                                        if (end == 2) {
+                                            proposed.push_back(tree);
+                                        }
+                                    });
+    REQUIRE(proposed.size() == 1);
+    REQUIRE(proposed[0].symbol() == Symb("Pre"));
+    REQUIRE(std::get<parser::Tree>(proposed[0].children()[0]).symbol() == Symb("Lex_ab"));
+    REQUIRE(!mentions(Symb("Lex_ab")));
+
+    // B -> C was collapsed and is put back by restore().
+    using Rhs = std::vector<parser::LetterProd::RhsType>;
+    const auto elided = optimizer.elided_categories(Symb("R"), Rhs {Symb("C")});
+    REQUIRE(elided.size() == 1);
+    REQUIRE(elided[0] == std::vector<Symb> {Symb("B")});
+    const auto collapsed = parser::Tree(Symb("R"), {parser::Tree(Symb("C"), {'c'}, 0.F)}, 0.F);
+    const auto restored = optimizer.restore(collapsed);
+    REQUIRE(restored.children().size() == 1);
+    auto const& restored_child = std::get<parser::Tree>(restored.children()[0]);
+    REQUIRE(restored_child.symbol() == Symb("B"));
+    REQUIRE(std::get<parser::Tree>(restored_child.children()[0]).symbol() == Symb("C"));
+
+    const auto plain = parser::ViterbiParser(grammar);
+    const auto optimized = parser::ViterbiParser(grammar, parser::OptimizerOptions {});
+
+    const std::vector<parser::LetterType> tokens {'a', 'b', 'c', 'd', 'c'};
+    auto expected = as_strings(plain.parse(tokens, 3));
+    auto actual = as_strings(optimized.parse(tokens, 3));
+
+    REQUIRE(!expected.empty());
+    REQUIRE(actual == expected);
+}
+
+TEST_CASE("Test", "[test_yield_bounds]")
+{
+    using Symb = parser::Nonterminal;
+    const auto grammar = parser::Pcfg(  //
+        Symb("S"),
+        {
+            {Symb("S"), {Symb("A"), Symb("R")}, 1.0},
+            {Symb("A"), {'A', 'A'}, 0.5},
+            {Symb("A"), {'A'}, 0.5},
+            {Symb("R"), {Symb("R"), Symb("B")}, 0.5},
+            {Symb("R"), {Symb("B")}, 0.5},
+            {Symb("B"), {'B'}, 1.0},
+            {Symb("D"), {Symb("B"), Symb("Undefined")}, 1.0},
+        });
+
+    REQUIRE(grammar.yield_bounds(Symb("A")).min == 1);
+    REQUIRE(grammar.yield_bounds(Symb("A")).max == 2);
+    REQUIRE(grammar.yield_bounds(Symb("R")).min == 1);
+    REQUIRE(grammar.yield_bounds(Symb("R")).max == parser::unbounded_yield);
+    REQUIRE(grammar.yield_bounds(Symb("S")).min == 2);
+    REQUIRE(grammar.yield_bounds(Symb("S")).max == parser::unbounded_yield);
+
+    // Categories that derive nothing have empty bounds.
+    REQUIRE(grammar.yield_bounds(Symb("D")).min > grammar.yield_bounds(Symb("D")).max);
+}
+
+TEST_CASE("Test", "[test_coarse_to_fine]")
+{
+    using Symb = parser::Nonterminal;
+    const auto grammar = parser::Pcfg(  //
+        Symb("Word"),
+        {
+            {Symb("Word"), {Symb("Stem_v"), Symb("End_v")}, 0.6F},
+            {Symb("Word"), {Symb("Stem_c"), Symb("End_c")}, 0.4F},
+            {Symb("Stem_v"), {'h', 'a'}, 0.7F},
+            {Symb("Stem_v"), {'h'}, 0.3F},
+            {Symb("Stem_c"), {'h', 'a', 'k'}, 1.0},
+            {Symb("End_v"), {'k', 'e'}, 0.5},
+            {Symb("End_v"), {Symb("End_v"), Symb("End_v")}, 0.5},
+            {Symb("End_c"), {'e'}, 1.0},
+            {Symb("End_c"), {'a', 'k', 'e'}, 1.0},
+        });
+
+    const auto exhaustive = parser::ViterbiParser(grammar, parser::OptimizerOptions {});
+    const auto coarse_to_fine =
+        parser::ViterbiParser(grammar, parser::OptimizerOptions {}, parser::CoarseToFineOptions {});
+
+    for (std::string word : {"hake", "hakeke", "hke", "hak"}) {
+        const std::vector<parser::LetterType> tokens(word.begin(), word.end());
+        REQUIRE(as_strings(coarse_to_fine.parse(tokens, 3)) == as_strings(exhaustive.parse(tokens, 3)));
+    }
+
+    // On "hake" the coarse parses through Stem over "ha" and over "h"
+    // carry 0.21 and 0.18 of a total of 0.99; a threshold of -1 prunes
+    // both but keeps Stem over "hak", which the best parse goes through.
+    auto options = parser::CoarseToFineOptions {};
+    options.log_threshold = -1.F;
+    const auto optimized = parser::OptimizedGrammar(grammar);
+    const auto coarse = parser::CoarseGrammar(optimized, options);
+    const std::vector<parser::LetterType> hake {'h', 'a', 'k', 'e'};
+    auto scratch = parser::CoarseScratch {};
+    const auto chart =
+        coarse.prune(parser::Lattice::from_letters(hake), optimized.lexicon(), scratch, parser::ParseLimits {});
+    const int stem = coarse.category(Symb("Stem_v"));
+    REQUIRE(stem == coarse.category(Symb("Stem_c")));
+    REQUIRE(chart.status() == parser::ParseStatus::Complete);
+    REQUIRE(!chart.allows(0, 2, stem));
+    REQUIRE(!chart.allows(0, 1, stem));
+    REQUIRE(chart.allows(0, 3, stem));
+
+    const auto thresholded = parser::ViterbiParser(grammar, parser::OptimizerOptions {}, options);
+    for (std::string word : {"hake", "hakeke", "hke", "hak"}) {
+        const std::vector<parser::LetterType> tokens(word.begin(), word.end());
+        REQUIRE(as_strings(thresholded.parse(tokens, 1)) == as_strings(exhaustive.parse(tokens, 1)));
+    }
+    REQUIRE(as_strings(thresholded.parse(hake, 3)).size() < as_strings(exhaustive.parse(hake, 3)).size());
+}
+
+TEST_CASE("Test", "[test_lattice]")
+{
+    using Symb = parser::Nonterminal;
+    const auto grammar = parser::Pcfg(  //
+        Symb("Word"),
+        {
+            {Symb("Word"), {Symb("Stem"), Symb("End")}, 1.0},
+            {Symb("Stem"), {'h', 'a'}, 0.6F},
+            {Symb("Stem"), {'h', 'o'}, 0.4F},
+            {Symb("Stem"), {'h'}, 0.1F},
+            {Symb("End"), {'k'}, 1.0},
+            {Symb("End"), {'o', 'k'}, 0.2F},
+        });
+    const auto parser = parser::ViterbiParser(grammar, parser::OptimizerOptions {});
+
+    const std::vector<parser::LetterType> tokens {'h', 'o', 'k'};
+    auto const linear = parser.parse(parser::Lattice::from_letters(tokens), 2);
+    REQUIRE(linear == parser.parse(tokens, 2));
+
+    // Two spellings of the second letter; the weights favour 'o'.
+    const auto lattice = parser::Lattice(4,
+                                         {
+                                             {0, 1, 'h'},
+                                             {1, 2, 'a', -3.0F},
+                                             {1, 2, 'o', -0.1F},
+                                             {2, 3, 'k'},
+                                         });
+    auto by_log_prob = [](auto const& lhs, auto const& rhs) { return lhs.log_prob < rhs.log_prob; };
+    auto const trees = parser.parse(lattice);
+    auto const expected_trees = parser.parse(tokens);
+    auto const& tree = *std::max_element(trees.begin(), trees.end(), by_log_prob);
+    auto const& expected = *std::max_element(expected_trees.begin(), expected_trees.end(), by_log_prob);
+    auto const& stem = std::get<parser::Tree>(tree.children()[0]);
+    REQUIRE(std::get<parser::LetterType>(stem.children()[1]) == 'o');
+    REQUIRE(std::abs(tree.log_prob - (expected.log_prob - 0.1F)) < 1e-5F);
+
+    // Two paths spell "hok"; each tree is kept once, with its best path.
+    const auto paths = parser::Lattice(5,
+                                       {
+                                           {0, 1, 'h'},
+                                           {1, 2, 'o', -2.0F},
+                                           {2, 4, 'k'},
+                                           {1, 3, 'o', -0.5F},
+                                           {3, 4, 'k'},
+                                       });
+    auto const path_trees = parser.parse(paths, 2);
+    REQUIRE(path_trees.size() == 2);
+    for (auto const& path_tree : path_trees) {
+        auto const same = linear.find(path_tree);
+        REQUIRE(same != linear.end());
+        REQUIRE(std::abs(path_tree.log_prob - (same->log_prob - 0.5F)) < 1e-5F);
+    }
+
+    REQUIRE_THROWS_AS(parser::Lattice(2, {{1, 0, 'h'}}), std::invalid_argument);
+}
+
+TEST_CASE("Test", "[test_parse_forest]")
+{
+    using Symb = parser::Nonterminal;
+    const auto grammar = parser::Pcfg(  //
+        Symb("S"),
+        {
+            {Symb("S"), {Symb("S"), Symb("S")}, 0.4F},
+            {Symb("S"), {Symb("X")}, 0.6F},
+            {Symb("X"), {Symb("Y")}, 1.0},
+            {Symb("Y"), {'a'}, 1.0},
+        });
+    const std::vector<parser::LetterType> tokens {'a', 'a', 'a', 'a'};
+
+    for (auto const& options : {parser::OptimizerOptions::none(), parser::OptimizerOptions {}}) {
+        const auto parser = parser::ViterbiParser(grammar, options);
+        auto const forest = parser.parse_forest(parser::Lattice::from_letters(tokens));
+
+        // One node per (symbol, span): S over each of the 10 spans, and
+        // X and Y over each letter.
+        REQUIRE(forest.nodes.size() == 18);
+        REQUIRE(forest.nodes[0].symbol == Symb("S"));
+        REQUIRE(forest.nodes[0].derivations.size() == 3);
+
+        auto const trees = parser.parse(tokens);
+        auto const best = std::max_element(
+            trees.begin(), trees.end(), [](auto const& lhs, auto const& rhs) { return lhs.log_prob < rhs.log_prob; });
+        REQUIRE(std::abs(forest.nodes[0].log_prob - best->log_prob) < 1e-5F);
+
+        // The forest still holds all 5 bracketings.
+        auto count_trees = [&](auto const& self, std::size_t node) -> int
+        {
+            int result = 0;
+            for (auto const& derivation : forest.nodes[node].derivations) {
+                int product = 1;
+                for (auto const& child : derivation.children) {
+                    if (std::holds_alternative<std::size_t>(child)) {
+                        product *= self(self, std::get<std::size_t>(child));
+                    }
+                }
+                result += product;
+            }
+            return result;
+        };
+        REQUIRE(count_trees(count_trees, 0) == 5);
+
+        auto const json = forest.json();
+        REQUIRE(json.at("labels").size() == 3);
+        REQUIRE(json.at("nodes").size() == forest.nodes.size());
+    }
+
+    const std::vector<parser::LetterType> unknown {'b'};
+    REQUIRE(parser::ViterbiParser(grammar).parse_forest(parser::Lattice::from_letters(unknown)).empty());
+}
+
+TEST_CASE("Test", "[test_parse_workspace]")
+{
+    using Symb = parser::Nonterminal;
+    auto prods_file = std::ifstream("examples/prods.json");
+    auto productions = parser::load_grammar(prods_file).productions;
+    const auto parser = parser::ViterbiParser(
+        parser::Pcfg(Symb("Noun"), productions), parser::OptimizerOptions {}, parser::CoarseToFineOptions {});
+
+    const std::string long_word = "hakeysssupnitaGipnita";
+    const std::string short_word = "hasimyen";
+    const auto long_lattice = parser::Lattice::from_letters(std::vector<char>(long_word.begin(), long_word.end()));
+    const auto short_lattice = parser::Lattice::from_letters(std::vector<char>(short_word.begin(), short_word.end()));
+
+    auto workspace = parser::ParseWorkspace {};
+    parser.parse(long_lattice, workspace, 3);
+    parser.parse(short_lattice, workspace, 3);
+
+    // Once warmed up on some inputs, the workspace has room for them, so
+    // none of its buffers grows.
+    const auto reserved = workspace.reserved_bytes();
+    REQUIRE(reserved > 0);
+    REQUIRE(not parser.parse(long_lattice, workspace, 3).empty());
+    REQUIRE(workspace.reserved_bytes() == reserved);
+    auto const short_parses = parser.parse(short_lattice, workspace, 3);
+    REQUIRE(workspace.reserved_bytes() == reserved);
+
+    REQUIRE(not short_parses.empty());
+    REQUIRE(short_parses.size() <= 3);
+
+    std::unordered_set<parser::Tree> trees;
+    for (auto const& ref : short_parses) {
+        trees.insert(parser.tree(workspace, ref));
+    }
+    REQUIRE(trees == parser.parse(short_lattice, 3));
+    REQUIRE(std::is_sorted(short_parses.begin(),
+                           short_parses.end(),
+                           [](auto const& lhs, auto const& rhs) { return lhs.log_prob > rhs.log_prob; }));
+
+    // Cells grow with the entries they get, not with `top_k`.
+    auto many = parser::ParseWorkspace {};
+    parser.parse(long_lattice, many, 1000);
+    REQUIRE(many.reserved_bytes() < 2 * reserved);
+}
+
+TEST_CASE("Test", "[test_parse_limits]")
+{
+    using Symb = parser::Nonterminal;
+    auto prods_file = std::ifstream("examples/prods.json");
+    auto productions = parser::load_grammar(prods_file).productions;
+    const auto parser = parser::ViterbiParser(parser::Pcfg(Symb("Noun"), productions));
+
+    const std::string word = "hakeysssupnitaGipnita";
+    const auto lattice = parser::Lattice::from_letters(std::vector<char>(word.begin(), word.end()));
+    auto workspace = parser::ParseWorkspace {};
+
+    auto cancelled = parser::ParseLimits {};
+    cancelled.cancellation.emplace();
+    cancelled.cancellation->cancel();
+    REQUIRE(parser.parse(lattice, workspace, 1, cancelled).empty());
+    REQUIRE(workspace.status() == parser::ParseStatus::Cancelled);
+
+    // The coarse pass stops on its own, before the chart is filled.
+    const auto grammar = parser::OptimizedGrammar(parser::Pcfg(Symb("Noun"), productions));
+    const auto coarse = parser::CoarseGrammar(grammar, parser::CoarseToFineOptions {});
+    auto scratch = parser::CoarseScratch {};
+    REQUIRE(coarse.prune(lattice, grammar.lexicon(), scratch, cancelled).status() == parser::ParseStatus::Cancelled);
+    REQUIRE(coarse.prune(lattice, grammar.lexicon(), scratch, {}).status() == parser::ParseStatus::Complete);
+
+    // Limits are checked before the chart and the coarse tables grow, and
+    // a budget that cannot hold them fails up front.
+    auto fresh = parser::ParseWorkspace {};
+    REQUIRE(parser.parse(lattice, fresh, 1, cancelled).empty());
+    REQUIRE(fresh.status() == parser::ParseStatus::Cancelled);
+    auto no_room = parser::ParseLimits {};
+    no_room.max_chart_entries = static_cast<std::size_t>(lattice.num_nodes() * lattice.num_nodes() - 1);
+    REQUIRE(parser.parse(lattice, fresh, 1, no_room).empty());
+    REQUIRE(fresh.status() == parser::ParseStatus::BudgetExceeded);
+    REQUIRE(fresh.reserved_bytes() == 0);
+
+    auto fresh_scratch = parser::CoarseScratch {};
+    REQUIRE(coarse.prune(lattice, grammar.lexicon(), fresh_scratch, no_room).status()
+            == parser::ParseStatus::BudgetExceeded);
+    REQUIRE(fresh_scratch.reserved_bytes() == 0);
+
+    auto expired = parser::ParseLimits {};
+    expired.deadline = std::chrono::steady_clock::now();
+    REQUIRE(parser.parse(lattice, workspace, 1, expired).empty());
+    REQUIRE(workspace.status() == parser::ParseStatus::DeadlineExceeded);
+
+    auto small_budget = parser::ParseLimits {};
+    small_budget.max_chart_entries = 10;
+    REQUIRE(parser.parse_forest(lattice, workspace, small_budget).empty());
+    REQUIRE(workspace.status() == parser::ParseStatus::BudgetExceeded);
+
+    // The workspace is good for the next parse.
+    auto generous = parser::ParseLimits {};
+    generous.deadline = std::chrono::steady_clock::now() + std::chrono::hours {1};
+    generous.max_chart_entries = 1'000'000;
+    generous.cancellation.emplace();
+    REQUIRE(parser.parse(lattice, workspace, 1, generous).size() == 1);
+    REQUIRE(workspace.status() == parser::ParseStatus::Complete);
+}
+
+TEST_CASE("Test", "[test_grammar_registry]")
+{
+    using Symb = parser::Nonterminal;
+    auto prods_file = std::ifstream("examples/prods.json");
+    auto productions = parser::load_grammar(prods_file).productions;
+    auto registry =
+        parser::GrammarRegistry(Symb("Noun"), productions, parser::OptimizerOptions {}, parser::CoarseToFineOptions {});
+
+    const std::string word = "hakeysssupnitaGipnita";
+    const auto tokens = std::vector<char>(word.begin(), word.end());
+
+    auto const before = registry.snapshot();
+    auto const before_trees = as_strings(before->parser.parse(tokens, 3));
+    REQUIRE(before->version == 0);
+
+    // Collapsed unary chains must keep probability 1.
+    auto retrained = productions;
+    for (std::size_t i = 0; i < retrained.size(); ++i) {
+        if (not parser::is_certain(retrained[i].prob)) {
+            retrained[i].prob *= i % 2 == 0 ? 0.5F : 0.9F;
+        }
+    }
+    registry.reweight(retrained);
+
+    auto const after = registry.snapshot();
+    REQUIRE(after->version == 1);
+    const auto rebuilt = parser::ViterbiParser(
+        parser::Pcfg(Symb("Noun"), retrained), parser::OptimizerOptions {}, parser::CoarseToFineOptions {});
+    REQUIRE(as_strings(after->parser.parse(tokens, 3)) == as_strings(rebuilt.parse(tokens, 3)));
+    REQUIRE(as_strings(after->parser.parse(tokens, 3)) != before_trees);
+
+    // A snapshot taken before the update is unaffected by it.
+    REQUIRE(as_strings(before->parser.parse(tokens, 3)) == before_trees);
+
+    auto reshaped = retrained;
+    reshaped.pop_back();
+    REQUIRE_THROWS_AS(registry.reweight(reshaped), std::invalid_argument);
+    REQUIRE(registry.snapshot() == after);
+
+    registry.load(reshaped);
+    REQUIRE(registry.snapshot()->version == 2);
+    REQUIRE(registry.snapshot()->productions.size() == reshaped.size());
+
+    // Readers see the versions in order while updates go on.
+    auto done = std::atomic<bool> {false};
+    auto in_order = std::atomic<bool> {true};
+    auto reader = std::thread {[&]
+                               {
+                                   std::uint64_t last = 0;
+                                   while (not done.load()) {
+                                       auto const current = registry.snapshot();
+                                       in_order = in_order and current->version >= last;
+                                       last = current->version;
+                                   }
+                               }};
+    for (int i = 0; i < 5; ++i) {
+        registry.reweight(reshaped);
+    }
+    done = true;
+    reader.join();
+    REQUIRE(in_order);
+    REQUIRE(registry.snapshot()->version == 7);
+}
+
+TEST_CASE("Test", "[test_tree_hash]")
+{
+    using Symb = parser::Nonterminal;
+    auto leaf = [](char letter, float log_prob) { return parser::Tree {Symb("X"), {letter}, log_prob}; };
+
+    const auto tree = parser::Tree {Symb("S"), {leaf('a', -1.F), leaf('b', -2.F)}, -3.F};
+    const auto same = parser::Tree {Symb("S"), {leaf('a', 0.F), leaf('b', 0.F)}, 0.F};
+    const auto other = parser::Tree {Symb("S"), {leaf('a', -1.F), leaf('c', -2.F)}, -3.F};
+
+    // Scores are not part of the structure.
+    REQUIRE(tree == same);
+    REQUIRE(tree.hash() == same.hash());
+    REQUIRE(std::hash<parser::Tree> {}(tree) == tree.hash());
+    REQUIRE(not(tree == other));
+    REQUIRE(tree.hash() != other.hash());
+
+    // Copies share their children.
+    const auto copy = tree;
+    REQUIRE(copy == tree);
+    REQUIRE(copy.hash() == tree.hash());
+    REQUIRE(&copy.children() == &tree.children());
+    REQUIRE(std::unordered_set<parser::Tree> {tree, same, other, copy}.size() == 2);
+
+    // Restoring keeps sharing the subtrees where nothing was elided.
+    const auto optimizer = parser::OptimizedGrammar(parser::Pcfg(  //
+        Symb("S"),
+        {
+            {Symb("S"), {Symb("A"), Symb("X")}, 1.0},
+            {Symb("A"), {Symb("X")}, 1.0},
+            {Symb("X"), {'a'}, 0.5},
+            {Symb("X"), {'b'}, 0.5},
+        }));
+    const auto collapsed = parser::Tree {Symb("S"), {leaf('a', -1.F), leaf('b', -1.F)}, -2.F};
+    const auto restored = optimizer.restore(collapsed);
+    auto const& wrapper = std::get<parser::Tree>(restored.children()[0]);
+    REQUIRE(wrapper.symbol() == Symb("A"));
+    REQUIRE(&std::get<parser::Tree>(wrapper.children()[0]).children()
+            == &std::get<parser::Tree>(collapsed.children()[0]).children());
+    REQUIRE(&std::get<parser::Tree>(restored.children()[1]).children()
+            == &std::get<parser::Tree>(collapsed.children()[1]).children());
+}